@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "common.hpp"
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <set>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    std::atomic<uint64_t> allocation_count{0};
+
+} // namespace
+
+// Replacing these is enough to see every allocation, since the array and
+// nothrow forms call them by default
+
+void * operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void * p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void * p) noexcept { std::free(p); }
+
+void operator delete(void * p, size_t) noexcept { std::free(p); }
+
+namespace cps::bench {
+
+    uint64_t allocations() { return allocation_count.load(std::memory_order_relaxed); }
+
+    AllocationCounter::AllocationCounter(benchmark::State & state_) : state{state_}, start{allocations()} {};
+
+    AllocationCounter::~AllocationCounter() {
+        state.counters["allocs/op"] =
+            benchmark::Counter(static_cast<double>(allocations() - start), benchmark::Counter::kAvgIterations);
+    }
+
+    fs::path scratch_prefix(std::string_view name) {
+        static std::set<std::string, std::less<>> cleaned;
+        const fs::path prefix = fs::temp_directory_path() / fmt::format("cps-config-bench-{}", name);
+        if (cleaned.find(name) == cleaned.end()) {
+            fs::remove_all(prefix);
+            fs::create_directories(prefix / "lib" / "cps");
+            cleaned.emplace(name);
+        }
+        return prefix;
+    }
+
+    void write_package(const fs::path & prefix, const std::string & name, size_t components,
+                       const std::vector<std::string> & require) {
+        std::ofstream out{prefix / "lib" / "cps" / fmt::format("{}.cps", name)};
+
+        std::vector<std::string> require_entries;
+        for (auto && r : require) {
+            require_entries.emplace_back(fmt::format(R"("{}": {{}})", r));
+        }
+        std::vector<std::string> quoted;
+        for (auto && r : require) {
+            quoted.emplace_back(fmt::format(R"("{}")", r));
+        }
+
+        std::vector<std::string> comps;
+        for (size_t i = 0; i < components; ++i) {
+            comps.emplace_back(fmt::format(R"("comp{0}": {{
+            "type": "archive",
+            "location": "@prefix@/lib/lib{1}{0}.a",
+            "includes": {{"c": ["@prefix@/include/{1}/{0}", "/usr/include/common"]}},
+            "defines": {{"c": ["{1}_{0}=1", "!{1}_OLD"]}},
+            "compile_flags": {{"c": ["-pthread"]}},
+            "link_libraries": ["m", "pthread"],
+            "requires": [{2}]
+        }})",
+                                           i, name, fmt::join(quoted, ", ")));
+        }
+        std::vector<std::string> defaults;
+        for (size_t i = 0; i < components; ++i) {
+            defaults.emplace_back(fmt::format(R"("comp{}")", i));
+        }
+
+        out << fmt::format(R"({{
+    "name": "{}",
+    "cps_version": "0.10.0",
+    "version": "1.2.3",
+    "requires": {{{}}},
+    "components": {{
+        {}
+    }},
+    "default_components": [{}]
+}}
+)",
+                           name, fmt::join(require_entries, ", "), fmt::join(comps, ",\n        "),
+                           fmt::join(defaults, ", "));
+    }
+
+} // namespace cps::bench
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cps::bench {
+
+    /// @brief The number of calls to operator new so far in this process
+    uint64_t allocations();
+
+    /// @brief Counts the allocations made while a benchmark runs
+    ///
+    /// Create one just before the benchmark loop, and it reports the
+    /// allocations per iteration as the "allocs/op" counter when destroyed.
+    class AllocationCounter {
+      public:
+        AllocationCounter(benchmark::State & state);
+        ~AllocationCounter();
+
+      private:
+        benchmark::State & state;
+        const uint64_t start;
+    };
+
+    /// @brief A directory for generated CPS files, emptied on first use
+    /// @param name Distinguishes the directories of different benchmarks
+    /// @return The prefix, CPS files go in <prefix>/lib/cps
+    std::filesystem::path scratch_prefix(std::string_view name);
+
+    /// @brief Write a CPS file
+    /// @param prefix Written to <prefix>/lib/cps/<name>.cps
+    /// @param name The name of the package
+    /// @param components The number of components, each with a handful of flags
+    /// @param require Packages required by every component
+    void write_package(const std::filesystem::path & prefix, const std::string & name, size_t components,
+                       const std::vector<std::string> & require);
+
+} // namespace cps::bench
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+// Writes a large tree of CPS files, for benchmarks and for stress testing
+// cps-config by hand
+
+#include "generator.hpp"
+
+#include <cxxopts.hpp>
+#include <fmt/format.h>
+
+#include <iostream>
+
+int main(int argc, char * argv[]) {
+    cxxopts::Options parser{"cps-generate", "Write a synthetic tree of CPS files"};
+    const cps::bench::TreeOptions defaults{};
+    const auto && number = [](auto value) {
+        return cxxopts::value<decltype(value)>()->default_value(std::to_string(value));
+    };
+    // clang-format off
+    parser.add_options()
+        ("output", "directory to write the tree to, which is emptied first", cxxopts::value<std::string>())
+        ("packages", "total number of packages", number(defaults.packages))
+        ("depth", "number of layers of packages", number(defaults.depth))
+        ("fan-out", "number of packages each package requires", number(defaults.fan_out))
+        ("components", "number of components per package", number(defaults.components))
+        ("prefixes", "number of prefixes to put on CPS_PATH", number(defaults.prefixes))
+        ("seed", "seed for the random choices", number(defaults.seed))
+        ("h,help", "print usage");
+    // clang-format on
+    parser.parse_positional({"output"});
+    parser.positional_help("<output>");
+    auto result = parser.parse(argc, argv);
+
+    if (result.count("help")) {
+        std::cout << parser.help() << std::endl;
+        return 0;
+    }
+    if (!result.count("output")) {
+        std::cerr << "An output directory is required" << std::endl;
+        return 1;
+    }
+
+    const cps::bench::TreeOptions options{
+        result["packages"].as<size_t>(),   result["depth"].as<size_t>(),    result["fan-out"].as<size_t>(),
+        result["components"].as<size_t>(), result["prefixes"].as<size_t>(), result["seed"].as<uint64_t>(),
+    };
+    auto && generated = cps::bench::generate_tree(result["output"].as<std::string>(), options);
+    if (!generated) {
+        std::cerr << generated.error() << std::endl;
+        return 1;
+    }
+    const cps::bench::Tree & tree = generated.value();
+
+    // Print something that can be evaluated by a shell, and roots to query
+    std::cout << fmt::format("CPS_PATH={}\n", tree.cps_path());
+    std::cout << fmt::format("# roots: {}\n", fmt::join(tree.roots, " "));
+    return 0;
+}
@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "generator.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+namespace cps::bench {
+
+    namespace {
+
+        /// @brief Written into the directory of every tree, so that it can safely be replaced
+        constexpr std::string_view marker = ".cps-generate";
+
+        /// @brief splitmix64, which unlike the standard distributions gives
+        ///        the same numbers with every standard library
+        class Random {
+          public:
+            Random(uint64_t seed) : state{seed} {};
+
+            uint64_t next() {
+                uint64_t z = (state += 0x9e3779b97f4a7c15);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+                return z ^ (z >> 31);
+            }
+
+            /// @brief A number in [low, high)
+            size_t between(size_t low, size_t high) { return low + static_cast<size_t>(next() % (high - low)); }
+
+          private:
+            uint64_t state;
+        };
+
+        struct Generated {
+            std::string name;
+            size_t layer;
+            size_t prefix;
+            unsigned major;
+            unsigned minor;
+            /// @brief Indexes of the required packages
+            std::vector<size_t> require;
+        };
+
+        std::string quoted(const std::vector<std::string> & values) {
+            std::vector<std::string> q;
+            q.reserve(values.size());
+            for (auto && v : values) {
+                q.emplace_back(fmt::format(R"("{}")", v));
+            }
+            return fmt::format("[{}]", fmt::join(q, ", "));
+        }
+
+        void write(const fs::path & prefix, const Generated & pkg, const std::string & version,
+                   const std::vector<Generated> & packages, size_t components) {
+            std::vector<std::string> require;
+            for (auto && r : pkg.require) {
+                const Generated & dep = packages[r];
+                require.emplace_back(fmt::format(R"("{}": {{"version": "{}.0"}})", dep.name, dep.major));
+            }
+
+            // The first component is the default, and pulls in all of the
+            // others. The required packages are shared out over the others,
+            // and alternate between needing their defaults and needing one of
+            // their components.
+            std::vector<std::vector<std::string>> comp_requires(components);
+            for (size_t i = 1; i < components; ++i) {
+                comp_requires[0].emplace_back(fmt::format(":c{}", i));
+            }
+            for (size_t i = 0; i < pkg.require.size(); ++i) {
+                const Generated & dep = packages[pkg.require[i]];
+                auto & target = comp_requires[components > 1 ? 1 + i % (components - 1) : 0];
+                if (i % 2 == 0) {
+                    target.emplace_back(dep.name);
+                } else {
+                    target.emplace_back(fmt::format("{}:c{}", dep.name, i % components));
+                }
+            }
+
+            std::vector<std::string> comps;
+            for (size_t i = 0; i < components; ++i) {
+                if (i == 0) {
+                    comps.emplace_back(fmt::format(R"("c0": {{
+            "type": "interface",
+            "includes": {{"c": ["@prefix@/include/{0}"], "cpp": ["@prefix@/include/{0}"]}},
+            "requires": {1}
+        }})",
+                                                   pkg.name, quoted(comp_requires[0])));
+                    continue;
+                }
+                const bool shared = i % 2 == 1;
+                comps.emplace_back(fmt::format(R"("c{0}": {{
+            "type": "{2}",
+            "location": "@prefix@/lib/lib{1}_c{0}.{3}",
+            "includes": {{"c": ["@prefix@/include/{1}/c{0}"]}},
+            "defines": {{"c": ["{1}_C{0}=1", "!{1}_C{0}_STATIC", "{1}_VERSION"]}},
+            "compile_flags": {{"c": ["-pthread"]}},
+            "link_libraries": ["m"],
+            "requires": {4}
+        }})",
+                                               i, pkg.name, shared ? "dylib" : "archive", shared ? "so" : "a",
+                                               quoted(comp_requires[i])));
+            }
+
+            std::ofstream out{prefix / "lib" / "cps" / fmt::format("{}.cps", pkg.name)};
+            out << fmt::format(R"({{
+    "name": "{}",
+    "cps_version": "0.10.0",
+    "version": "{}",
+    "requires": {{{}}},
+    "components": {{
+        {}
+    }},
+    "default_components": ["c0"]
+}}
+)",
+                               pkg.name, version, fmt::join(require, ", "), fmt::join(comps, ",\n        "));
+        }
+
+    } // namespace
+
+    std::string Tree::cps_path() const {
+        std::vector<std::string> paths;
+        paths.reserve(prefixes.size());
+        for (auto && p : prefixes) {
+            paths.emplace_back(p.string());
+        }
+        return fmt::format("{}", fmt::join(paths, ":"));
+    }
+
+    tl::expected<Tree, std::string> generate_tree(const fs::path & dir, const TreeOptions & options) {
+        const size_t depth = std::clamp<size_t>(options.depth, 1, std::max<size_t>(options.packages, 1));
+        const size_t prefixes = std::max<size_t>(options.prefixes, 1);
+        const size_t components = std::max<size_t>(options.components, 1);
+        Random rand{options.seed};
+
+        // Only replace what an earlier tree left behind, anything else may be
+        // a mistyped path
+        std::error_code ec;
+        if (fs::exists(dir, ec) && !fs::is_empty(dir, ec) && !fs::exists(dir / marker, ec)) {
+            return tl::unexpected(
+                fmt::format("{} is not empty and wasn't written by cps-generate, not replacing it", dir.string()));
+        }
+        fs::remove_all(dir);
+        fs::create_directories(dir);
+        std::ofstream{dir / marker};
+
+        Tree tree{};
+        for (size_t i = 0; i < prefixes; ++i) {
+            tree.prefixes.emplace_back(dir / fmt::format("prefix{}", i));
+            fs::create_directories(tree.prefixes.back() / "lib" / "cps");
+        }
+
+        std::vector<Generated> packages;
+        packages.reserve(options.packages);
+        for (size_t i = 0; i < options.packages; ++i) {
+            packages.push_back(Generated{fmt::format("pkg{}", i), i * depth / options.packages, i % prefixes,
+                                         static_cast<unsigned>(rand.between(1, 6)),
+                                         static_cast<unsigned>(rand.between(0, 20)),
+                                         {}});
+        }
+
+        // Packages are sorted by layer, so the first package of each layer
+        // can be found by a binary search
+        const auto && layer_start = [&packages](size_t layer) {
+            return static_cast<size_t>(
+                std::lower_bound(packages.begin(), packages.end(), layer,
+                                 [](const Generated & p, size_t l) { return p.layer < l; }) -
+                packages.begin());
+        };
+
+        for (auto && pkg : packages) {
+            // The last layer requires nothing
+            if (pkg.layer + 1 >= depth) {
+                continue;
+            }
+            const size_t next = layer_start(pkg.layer + 1);
+            const size_t after = layer_start(pkg.layer + 2);
+            const size_t wanted = std::min(options.fan_out, packages.size() - next);
+            // Most dependencies come from the next layer, the rest from
+            // anywhere deeper
+            for (size_t attempts = 0; pkg.require.size() < wanted && attempts < wanted * 8; ++attempts) {
+                const bool deeper = after < packages.size() && rand.between(0, 4) == 0;
+                const size_t r = deeper ? rand.between(after, packages.size()) : rand.between(next, after);
+                if (std::find(pkg.require.begin(), pkg.require.end(), r) == pkg.require.end()) {
+                    pkg.require.emplace_back(r);
+                }
+            }
+        }
+
+        for (auto && pkg : packages) {
+            write(tree.prefixes[pkg.prefix], pkg, fmt::format("{}.{}.0", pkg.major, pkg.minor), packages, components);
+            if (pkg.layer == 0) {
+                tree.roots.emplace_back(pkg.name);
+            } else if (pkg.prefix > 0 && rand.between(0, 10) == 0) {
+                // An older copy, which comes first on CPS_PATH
+                write(tree.prefixes[pkg.prefix - 1], pkg, fmt::format("{}.9", pkg.major - 1), packages, components);
+            }
+        }
+
+        return tree;
+    }
+
+} // namespace cps::bench
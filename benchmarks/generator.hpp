@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include <tl/expected.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace cps::bench {
+
+    /// @brief The shape of a generated tree of CPS files
+    struct TreeOptions {
+        /// @brief The total number of packages
+        size_t packages = 1000;
+        /// @brief The number of layers packages are spread over, packages only
+        ///        require packages in deeper layers
+        size_t depth = 8;
+        /// @brief The number of packages each package requires
+        size_t fan_out = 4;
+        /// @brief The number of components in each package
+        size_t components = 4;
+        /// @brief The number of prefixes, each is one entry of CPS_PATH
+        size_t prefixes = 4;
+        /// @brief The same seed and options always generate the same tree
+        uint64_t seed = 1;
+    };
+
+    /// @brief A generated tree of CPS files
+    struct Tree {
+        /// @brief The prefixes, in the order they should be searched
+        std::vector<std::filesystem::path> prefixes;
+        /// @brief The packages in the first layer, which nothing requires
+        std::vector<std::string> roots;
+
+        /// @brief The prefixes joined as the value of CPS_PATH
+        std::string cps_path() const;
+    };
+
+    /// @brief Write a tree of CPS files that looks like a distro or a monorepo
+    ///
+    /// Every package requires packages from deeper layers, mostly from the
+    /// next one, so the dependency graph is full of diamonds. Each component
+    /// requires some of those packages, either by their defaults or by a
+    /// single component, and every requirement has a minimum version. Some
+    /// packages also have an older copy in an earlier prefix, which is too old
+    /// for anything that requires it and so has to be skipped.
+    ///
+    /// @param dir Emptied, and then the prefixes are created in it. To make
+    ///        sure nothing else is lost, this must not exist, be empty, or be a
+    ///        tree written by an earlier call.
+    /// @return The tree
+    tl::expected<Tree, std::string> generate_tree(const std::filesystem::path & dir, const TreeOptions & options);
+
+} // namespace cps::bench
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "common.hpp"
+
+#include "cps/loader.hpp"
+
+#include <fmt/format.h>
+
+namespace fs = std::filesystem;
+
+namespace cps::loader::bench {
+    namespace {
+
+        /// @param parse_components Also parse every component, which the
+        ///        streaming backend otherwise leaves until it is used
+        void load(benchmark::State & state, Backend backend, bool parse_components) {
+            const size_t components = static_cast<size_t>(state.range(0));
+            const fs::path prefix = cps::bench::scratch_prefix("loader");
+            const std::string name = fmt::format("components{}", components);
+            cps::bench::write_package(prefix, name, components, {});
+            const fs::path file = prefix / "lib" / "cps" / fmt::format("{}.cps", name);
+
+            {
+                cps::bench::AllocationCounter allocs{state};
+                for (auto _ : state) {
+                    auto && p = loader::load(file, backend);
+                    if (!p) {
+                        state.SkipWithError(p.error().c_str());
+                        break;
+                    }
+                    if (parse_components) {
+                        for (size_t i = 0; i < components; ++i) {
+                            benchmark::DoNotOptimize(p->get_component(fmt::format("comp{}", i)));
+                        }
+                    }
+                    benchmark::DoNotOptimize(p);
+                }
+            }
+            state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * fs::file_size(file)));
+        }
+        BENCHMARK_CAPTURE(load, jsoncpp, Backend::jsoncpp, false)->RangeMultiplier(10)->Range(1, 1000);
+        BENCHMARK_CAPTURE(load, streaming, Backend::streaming, false)->RangeMultiplier(10)->Range(1, 1000);
+        BENCHMARK_CAPTURE(load, streaming_all_components, Backend::streaming, true)
+            ->RangeMultiplier(10)
+            ->Range(1, 1000);
+
+    } // namespace
+} // namespace cps::loader::bench
+
+BENCHMARK_MAIN();
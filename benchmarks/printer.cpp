@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "common.hpp"
+
+#include "cps/printer.hpp"
+
+#include <fmt/format.h>
+
+namespace cps::printer::bench {
+    namespace {
+
+        search::Result make_result(size_t size) {
+            search::Result r{};
+            r.version = "1.2.3";
+            for (size_t i = 0; i < size; ++i) {
+                r.includes[loader::KnownLanguages::c].emplace_back(fmt::format("/usr/include/package{}", i));
+                r.compile_flags[loader::KnownLanguages::c].emplace_back("-pthread");
+                r.defines[loader::KnownLanguages::c].emplace_back(fmt::format("PACKAGE{}", i), "1");
+                r.link_libraries.emplace_back(fmt::format("package{}", i));
+            }
+            return r;
+        }
+
+        void pkgconf(benchmark::State & state) {
+            const search::Result r = make_result(static_cast<size_t>(state.range(0)));
+            Config conf{};
+            conf.cflags = true;
+            conf.defines = true;
+            conf.includes = true;
+            conf.libs_link = true;
+
+            std::string out;
+            {
+                cps::bench::AllocationCounter allocs{state};
+                for (auto _ : state) {
+                    out.clear();
+                    printer::pkgconf(r, conf, out);
+                    benchmark::DoNotOptimize(out);
+                }
+            }
+            state.SetItemsProcessed(state.iterations() * state.range(0) * 4);
+        }
+        BENCHMARK(pkgconf)->RangeMultiplier(10)->Range(10, 1000);
+
+    } // namespace
+} // namespace cps::printer::bench
+
+BENCHMARK_MAIN();
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "common.hpp"
+#include "generator.hpp"
+
+#include "cps/loader.hpp"
+#include "cps/search.hpp"
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <optional>
+
+namespace fs = std::filesystem;
+
+namespace cps::search::bench {
+    namespace {
+
+        constexpr size_t width = 10;
+
+        /// @brief Write a graph of packages in layers of ten
+        ///
+        /// Each package requires two packages of the next layer, so the graph
+        /// is full of diamonds, and the root requires the whole first layer.
+        /// @return The name of the root package
+        std::string write_dag(const fs::path & prefix, size_t packages) {
+            const size_t layers = std::max<size_t>(packages / width, 1);
+            const auto && name = [packages](size_t layer, size_t i) {
+                return fmt::format("dag{}_{}_{}", packages, layer, i % width);
+            };
+
+            for (size_t layer = 0; layer < layers; ++layer) {
+                for (size_t i = 0; i < width; ++i) {
+                    std::vector<std::string> require;
+                    if (layer + 1 < layers) {
+                        require = {name(layer + 1, i), name(layer + 1, i + 1)};
+                    }
+                    cps::bench::write_package(prefix, name(layer, i), 2, require);
+                }
+            }
+
+            std::vector<std::string> first;
+            for (size_t i = 0; i < width; ++i) {
+                first.emplace_back(name(0, i));
+            }
+            const std::string root = fmt::format("dag{}", packages);
+            cps::bench::write_package(prefix, root, 1, first);
+            return root;
+        }
+
+        void find(benchmark::State & state) {
+            const size_t packages = static_cast<size_t>(state.range(0));
+            const fs::path prefix = cps::bench::scratch_prefix("search");
+            const std::string root = write_dag(prefix, packages);
+
+            // Only look at the generated packages, and not at any index the
+            // user has built
+            const Context context{Options{{prefix}, std::nullopt}};
+
+            {
+                cps::bench::AllocationCounter allocs{state};
+                for (auto _ : state) {
+                    auto && r = find_package(context, root);
+                    if (!r) {
+                        state.SkipWithError(r.error().c_str());
+                        break;
+                    }
+                    benchmark::DoNotOptimize(r);
+                }
+            }
+            state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * (packages + 1)));
+        }
+        BENCHMARK(find)->RangeMultiplier(10)->Range(10, 1000)->Unit(benchmark::kMicrosecond);
+
+        /// @brief Find one of the roots of a generated tree of the given size
+        void find_tree(benchmark::State & state) {
+            cps::bench::TreeOptions options{};
+            options.packages = static_cast<size_t>(state.range(0));
+            auto && generated = cps::bench::generate_tree(fs::temp_directory_path() / "cps-config-bench-tree", options);
+            if (!generated) {
+                state.SkipWithError(generated.error().c_str());
+                return;
+            }
+            const cps::bench::Tree & tree = generated.value();
+
+            const Context context{Options{tree.prefixes, std::nullopt}};
+
+            std::atomic<size_t> loads{0};
+            const Loader load = [&loads](const fs::path & path) {
+                ++loads;
+                return loader::load(path);
+            };
+
+            {
+                cps::bench::AllocationCounter allocs{state};
+                for (auto _ : state) {
+                    auto && r = find_package(context, tree.roots.front(), {}, true, load);
+                    if (!r) {
+                        state.SkipWithError(r.error().c_str());
+                        break;
+                    }
+                    benchmark::DoNotOptimize(r);
+                }
+            }
+            state.counters["loads/op"] =
+                benchmark::Counter(static_cast<double>(loads), benchmark::Counter::kAvgIterations);
+        }
+        BENCHMARK(find_tree)->Arg(1000)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+    } // namespace
+} // namespace cps::search::bench
+
+BENCHMARK_MAIN();
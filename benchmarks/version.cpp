@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "common.hpp"
+
+#include "cps/version.hpp"
+
+#include <fmt/format.h>
+
+#include <string>
+#include <utility>
+
+namespace cps::version::bench {
+    namespace {
+
+        /// @brief Two versions with the given number of parts, which differ only in the last
+        std::pair<std::string, std::string> versions(int64_t parts) {
+            std::string left = "1";
+            for (int64_t i = 1; i < parts; ++i) {
+                left += fmt::format(".{}", i + 1);
+            }
+            return {left + "0", left + "1"};
+        }
+
+        void simple_strings(benchmark::State & state) {
+            auto && [left, right] = versions(state.range(0));
+            {
+                cps::bench::AllocationCounter allocs{state};
+                for (auto _ : state) {
+                    benchmark::DoNotOptimize(compare(left, Operator::lt, right, Schema::simple));
+                }
+            }
+            state.SetItemsProcessed(state.iterations());
+        }
+        BENCHMARK(simple_strings)->DenseRange(2, 8, 3);
+
+        void simple_parsed(benchmark::State & state) {
+            auto && [l, r] = versions(state.range(0));
+            const Version left = Version::parse(l).value();
+            const Version right = Version::parse(r).value();
+            {
+                cps::bench::AllocationCounter allocs{state};
+                for (auto _ : state) {
+                    benchmark::DoNotOptimize(compare(left, Operator::lt, right));
+                }
+            }
+            state.SetItemsProcessed(state.iterations());
+        }
+        BENCHMARK(simple_parsed)->DenseRange(2, 8, 3);
+
+        void rpm(benchmark::State & state) {
+            {
+                cps::bench::AllocationCounter allocs{state};
+                for (auto _ : state) {
+                    benchmark::DoNotOptimize(rpm_compare("2.38.1-1.fc39", "2.38.10~rc1-1.fc39"));
+                }
+            }
+            state.SetItemsProcessed(state.iterations());
+        }
+        BENCHMARK(rpm);
+
+        void dpkg(benchmark::State & state) {
+            {
+                cps::bench::AllocationCounter allocs{state};
+                for (auto _ : state) {
+                    benchmark::DoNotOptimize(dpkg_compare("1:2.38.1-1ubuntu1", "1:2.38.10~rc1-1ubuntu1"));
+                }
+            }
+            state.SetItemsProcessed(state.iterations());
+        }
+        BENCHMARK(dpkg);
+
+    } // namespace
+} // namespace cps::version::bench
+
+BENCHMARK_MAIN();
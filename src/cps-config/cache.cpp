@@ -0,0 +1,327 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "cache.hpp"
+
+#include "inputs.hpp"
+
+#include "cps/config.hpp"
+
+#include <fmt/format.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string_view>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+namespace cps_config::cache {
+
+    namespace {
+
+        /// @brief The first line of every entry, bumped whenever the layout changes
+        constexpr std::string_view magic = "cps-config-result 1";
+
+        /// @brief Once there are more entries than this, the oldest half are removed
+        constexpr size_t max_entries = 1024;
+
+        /// @brief Roughly one process in this many checks whether there are too many entries
+        constexpr uint64_t prune_interval = 64;
+
+        using inputs::Stamp;
+
+        struct Entry {
+            /// @brief Everything the answer was asked for with
+            std::string key;
+            int status = 0;
+            std::string out;
+            std::string err;
+            std::vector<Stamp> world;
+            /// @brief Every CPS file read, and its stamp when it was read
+            std::vector<std::pair<std::string, Stamp>> files;
+        };
+
+        std::string make_key(const fs::path & cwd, const std::vector<std::string> & args) {
+            // Another version may answer differently
+            std::string key{CPS_VERSION};
+            key.push_back('\0');
+            key.append(cwd.string());
+            for (const std::vector<std::string> & list : {inputs::current_environment(), args}) {
+                key.push_back('\0');
+                for (auto && s : list) {
+                    key.append(s);
+                    key.push_back('\0');
+                }
+            }
+            return key;
+        }
+
+        // An entry is a sequence of numbers, each followed by a newline, and
+        // strings, which are their length and a newline followed by their
+        // bytes and a newline.
+
+        void put(std::string & buf, int64_t n) { fmt::format_to(std::back_inserter(buf), "{}\n", n); }
+
+        void put(std::string & buf, std::string_view s) {
+            put(buf, static_cast<int64_t>(s.size()));
+            buf.append(s);
+            buf.push_back('\n');
+        }
+
+        void put(std::string & buf, const Stamp & st) {
+            fmt::format_to(std::back_inserter(buf), "{} {} {} {} {}\n", st.exists ? 1 : 0, st.mtime, st.ctime,
+                           st.inode, st.size);
+        }
+
+        std::string serialize(const Entry & e) {
+            std::string buf{magic};
+            buf.push_back('\n');
+            put(buf, e.key);
+            put(buf, static_cast<int64_t>(e.status));
+            put(buf, e.out);
+            put(buf, e.err);
+            put(buf, static_cast<int64_t>(e.world.size()));
+            for (auto && st : e.world) {
+                put(buf, st);
+            }
+            put(buf, static_cast<int64_t>(e.files.size()));
+            for (auto && [path, st] : e.files) {
+                put(buf, path);
+                put(buf, st);
+            }
+            return buf;
+        }
+
+        class Parser {
+          public:
+            Parser(std::string_view b) : buf{b} {};
+
+            template <typename T> std::optional<T> number(char end = '\n') {
+                T value{};
+                auto && [ptr, ec] = std::from_chars(buf.data(), buf.data() + buf.size(), value);
+                if (ec != std::errc{} || ptr == buf.data() + buf.size() || *ptr != end) {
+                    return std::nullopt;
+                }
+                buf.remove_prefix(static_cast<size_t>(ptr - buf.data()) + 1);
+                return value;
+            }
+
+            std::optional<std::string_view> string() {
+                const std::optional<size_t> size = number<size_t>();
+                if (!size || buf.size() <= size.value() || buf[size.value()] != '\n') {
+                    return std::nullopt;
+                }
+                const std::string_view s = buf.substr(0, size.value());
+                buf.remove_prefix(size.value() + 1);
+                return s;
+            }
+
+            std::optional<Stamp> stamp() {
+                auto && exists = number<int>(' ');
+                auto && mtime = number<int64_t>(' ');
+                auto && ctime = number<int64_t>(' ');
+                auto && inode = number<uint64_t>(' ');
+                auto && size = number<int64_t>();
+                if (!exists || !mtime || !ctime || !inode || !size) {
+                    return std::nullopt;
+                }
+                return Stamp{exists.value() != 0, mtime.value(), ctime.value(), inode.value(), size.value()};
+            }
+
+            bool line(std::string_view expected) {
+                if (buf.substr(0, expected.size()) != expected || buf.size() <= expected.size() ||
+                    buf[expected.size()] != '\n') {
+                    return false;
+                }
+                buf.remove_prefix(expected.size() + 1);
+                return true;
+            }
+
+          private:
+            std::string_view buf;
+        };
+
+        /// @brief Read an entry
+        /// @return The entry, or nothing if it is missing, damaged or from another version
+        std::optional<Entry> read(const fs::path & file) {
+            std::ifstream in{file, std::ios::binary};
+            if (!in) {
+                return std::nullopt;
+            }
+            std::ostringstream contents;
+            contents << in.rdbuf();
+            const std::string data = std::move(contents).str();
+
+            Parser p{data};
+            if (!p.line(magic)) {
+                return std::nullopt;
+            }
+            Entry e{};
+            auto && key = p.string();
+            auto && status = p.number<int>();
+            auto && out = p.string();
+            auto && err = p.string();
+            auto && world = p.number<size_t>();
+            if (!key || !status || !out || !err || !world) {
+                return std::nullopt;
+            }
+            e.key = key.value();
+            e.status = status.value();
+            e.out = out.value();
+            e.err = err.value();
+            for (size_t i = 0; i < world.value(); ++i) {
+                auto && st = p.stamp();
+                if (!st) {
+                    return std::nullopt;
+                }
+                e.world.emplace_back(st.value());
+            }
+            auto && files = p.number<size_t>();
+            if (!files) {
+                return std::nullopt;
+            }
+            for (size_t i = 0; i < files.value(); ++i) {
+                auto && path = p.string();
+                auto && st = p.stamp();
+                if (!path || !st) {
+                    return std::nullopt;
+                }
+                e.files.emplace_back(path.value(), st.value());
+            }
+            return e;
+        }
+
+        /// @brief Remove the oldest half of the entries, if there are too many
+        void prune(const fs::path & dir) {
+            std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+            std::error_code ec;
+            for (auto && f : fs::directory_iterator{dir, ec}) {
+                // Leave other processes' temporary files alone
+                if (f.path().extension() != ".tmp") {
+                    entries.emplace_back(f.last_write_time(ec), f.path());
+                }
+            }
+            if (entries.size() <= max_entries) {
+                return;
+            }
+            std::sort(entries.begin(), entries.end());
+            for (size_t i = 0; i < entries.size() / 2; ++i) {
+                fs::remove(entries[i].second, ec);
+            }
+        }
+
+        /// @brief Write an entry, failing quietly since the cache is only an optimization
+        void write(const fs::path & file, const Entry & e) {
+            std::error_code ec;
+            fs::create_directories(file.parent_path(), ec);
+            if (ec) {
+                return;
+            }
+
+            // Write to a temporary file and rename it into place, so that
+            // another process never sees a partially written entry
+            const fs::path tmp = fmt::format("{}.{}.tmp", file.string(), ::getpid());
+            {
+                std::ofstream out{tmp, std::ios::binary};
+                out << serialize(e);
+                if (!out) {
+                    fs::remove(tmp, ec);
+                    return;
+                }
+            }
+            fs::rename(tmp, file, ec);
+            if (ec) {
+                fs::remove(tmp, ec);
+                return;
+            }
+            // Listing the directory costs far more than writing the entry,
+            // so only do it now and then. Each process writes at most one
+            // entry, and process IDs are handed out in turn.
+            if (static_cast<uint64_t>(::getpid()) % prune_interval == 0) {
+                prune(file.parent_path());
+            }
+        }
+
+    } // namespace
+
+    std::optional<fs::path> directory() {
+        if (const char * env = std::getenv("XDG_CACHE_HOME"); env && env[0] != '\0') {
+            return fs::path{env} / "cps-config" / "results";
+        }
+        if (const char * env = std::getenv("HOME"); env && env[0] != '\0') {
+            return fs::path{env} / ".cache" / "cps-config" / "results";
+        }
+        return std::nullopt;
+    }
+
+    bool enabled(const std::vector<std::string> & args) {
+        const char * cache = std::getenv("CPS_CONFIG_CACHE");
+        if (cache == nullptr || cache[0] == '\0' || std::string_view{cache} == "0") {
+            return false;
+        }
+        // A trace or statistics must describe real work
+        if (const char * env = std::getenv("CPS_CONFIG_TRACE"); env && env[0] != '\0') {
+            return false;
+        }
+        if (std::any_of(args.begin(), args.end(), [](std::string_view a) {
+                return a == "--daemon" || a == "--batch" || a == "--build-index" || a == "--stats" ||
+                       a.substr(0, 7) == "--trace" || a.substr(0, 9) == "--compile";
+            })) {
+            return false;
+        }
+        return directory().has_value();
+    }
+
+    int answer(const std::vector<std::string> & args, std::string & out, std::string & err,
+               const daemon::Handler & run, const cps::search::Loader & load) {
+        std::error_code ec;
+        const fs::path cwd = fs::current_path(ec);
+        const std::string key = make_key(cwd, args);
+        const fs::path file = directory().value() / fmt::format("{:016x}", inputs::hash(key));
+
+        // The stamps are taken before the query is run, so that anything
+        // changed while it runs makes the entry stale. Where it can be found,
+        // cps-config itself is included, so that a new build of the same
+        // version doesn't reuse the answers of the last one.
+        const daemon::Scope scope = daemon::local_scope();
+        std::vector<Stamp> world = inputs::world(scope.options);
+#ifdef __linux__
+        world.emplace_back(inputs::stamp("/proc/self/exe"));
+#endif
+
+        if (auto && hit = read(file); hit && hit->key == key && hit->world == world &&
+                                          std::all_of(hit->files.begin(), hit->files.end(), [](auto && f) {
+                                              return inputs::stamp(f.first) == f.second;
+                                          })) {
+            out += hit->out;
+            err += hit->err;
+            return hit->status;
+        }
+
+        Entry entry{key, 0, "", "", std::move(world), {}};
+        std::mutex files_lock;
+        const cps::search::Loader record = [&entry, &files_lock, &load](const fs::path & path) {
+            const Stamp st = inputs::stamp(path);
+            {
+                const std::lock_guard<std::mutex> guard{files_lock};
+                entry.files.emplace_back(path.string(), st);
+            }
+            return load(path);
+        };
+        entry.status = run(args, entry.out, entry.err, scope, record);
+        out += entry.out;
+        err += entry.err;
+        write(file, entry);
+        return entry.status;
+    }
+
+} // namespace cps_config::cache
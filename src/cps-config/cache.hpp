@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include "daemon.hpp"
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace cps_config::cache {
+
+    /// @brief The directory answers are cached in
+    ///
+    /// This is $XDG_CACHE_HOME/cps-config/results, or ~/.cache/cps-config/results,
+    /// or nothing if neither is set.
+    std::optional<std::filesystem::path> directory();
+
+    /// @brief Whether a query may be answered from the cache
+    ///
+    /// The cache is only used if CPS_CONFIG_CACHE is set to something other
+    /// than 0, so that nothing is written to the user's home directory unless
+    /// they ask for it. Queries which do more than print an answer, or which
+    /// report on the work done to answer them, are never cached.
+    bool enabled(const std::vector<std::string> & args);
+
+    /// @brief Answer a query from the cache, or run it and cache the answer
+    ///
+    /// An answer is only reused if the environment, the working directory,
+    /// the search directories, the index, and every CPS file read to produce
+    /// it are unchanged. Answers are written to a temporary file and renamed
+    /// into place, so any number of processes can share the cache.
+    ///
+    /// @param args The full command line, including argv[0]
+    /// @param run Answers the query if it is not cached
+    /// @param load Used by run to read each CPS file
+    /// @return The exit status
+    int answer(const std::vector<std::string> & args, std::string & out, std::string & err,
+               const daemon::Handler & run, const cps::search::Loader & load);
+
+} // namespace cps_config::cache
@@ -0,0 +1,639 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "daemon.hpp"
+
+#include "inputs.hpp"
+#include "lru.hpp"
+
+#include "cps/error.hpp"
+#include "cps/loader.hpp"
+#include "cps/stats.hpp"
+
+#include <fmt/format.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+namespace cps_config::daemon {
+
+    namespace {
+
+        /// @brief Upper bound on the size of any string or list in a message
+        constexpr uint32_t max_length = 1 << 20;
+
+        /// @brief How long the daemon waits for a client to send a query or read the answer
+        ///
+        /// A client which stalls only holds up the worker answering it, until
+        /// this runs out.
+        constexpr std::chrono::milliseconds request_timeout{1000};
+
+        /// @brief How long a client waits for an answer before answering the query itself
+        constexpr std::chrono::milliseconds answer_timeout{5000};
+
+        /// @brief Upper bound on the number of CPS files kept between queries
+        constexpr size_t max_packages = 8192;
+
+        /// @brief Upper bound on the number of answers kept between queries
+        constexpr size_t max_results = 1024;
+
+        /// @brief Upper bound on the number of search contexts kept, one for each set of search directories
+        constexpr size_t max_contexts = 16;
+
+        /// @brief The number of queries answered at once
+        ///
+        /// Most of a query is spent waiting on the filesystem or on the
+        /// client, so there are more of these than there are cores.
+        constexpr size_t worker_count = 32;
+
+        /// @brief Upper bound on the connections waiting for a worker
+        ///
+        /// A client turned away because there are more answers the query
+        /// itself, which is quicker than waiting for a daemon this far behind.
+        constexpr size_t max_pending = 1024;
+
+        struct Socket {
+            ~Socket() {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+            const int fd;
+        };
+
+        using inputs::Stamp;
+        using inputs::stamp;
+
+        sockaddr_un address(const fs::path & path) {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+            return addr;
+        }
+
+        /// @brief Make reads and writes on a socket fail once they have waited this long
+        tl::expected<void, std::string> set_timeout(int fd, std::chrono::milliseconds timeout) {
+            const auto && secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+            const timeval tv{static_cast<time_t>(secs.count()),
+                             static_cast<suseconds_t>(
+                                 std::chrono::duration_cast<std::chrono::microseconds>(timeout - secs).count())};
+            if (::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) != 0 ||
+                ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) != 0) {
+                return tl::unexpected(fmt::format("Could not set socket timeout: {}", std::strerror(errno)));
+            }
+            return {};
+        }
+
+        tl::expected<void, std::string> write_all(int fd, std::string_view data) {
+            while (!data.empty()) {
+                const ssize_t n = ::write(fd, data.data(), data.size());
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return tl::unexpected("Timed out writing to socket");
+                    }
+                    return tl::unexpected(fmt::format("Could not write to socket: {}", std::strerror(errno)));
+                }
+                data.remove_prefix(static_cast<size_t>(n));
+            }
+            return {};
+        }
+
+        tl::expected<void, std::string> read_all(int fd, char * data, size_t size) {
+            while (size > 0) {
+                const ssize_t n = ::read(fd, data, size);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return tl::unexpected("Timed out reading from socket");
+                    }
+                    return tl::unexpected(fmt::format("Could not read from socket: {}", std::strerror(errno)));
+                }
+                if (n == 0) {
+                    return tl::unexpected("Connection closed mid message");
+                }
+                data += n;
+                size -= static_cast<size_t>(n);
+            }
+            return {};
+        }
+
+        // Messages are a sequence of native endian 32-bit integers and strings,
+        // where a string is its length followed by its bytes. Both ends are
+        // always the same binary on the same machine.
+
+        void put(std::string & buf, uint32_t v) { buf.append(reinterpret_cast<const char *>(&v), sizeof v); }
+
+        void put(std::string & buf, std::string_view s) {
+            put(buf, static_cast<uint32_t>(s.size()));
+            buf.append(s);
+        }
+
+        void put(std::string & buf, const std::vector<std::string> & list) {
+            put(buf, static_cast<uint32_t>(list.size()));
+            for (auto && s : list) {
+                put(buf, s);
+            }
+        }
+
+        tl::expected<uint32_t, std::string> get_u32(int fd) {
+            uint32_t v;
+            if (auto && r = read_all(fd, reinterpret_cast<char *>(&v), sizeof v); !r) {
+                return tl::unexpected(r.error());
+            }
+            return v;
+        }
+
+        tl::expected<std::string, std::string> get_string(int fd) {
+            const uint32_t size = CPS_TRY(get_u32(fd));
+            if (size > max_length) {
+                return tl::unexpected("Message too large");
+            }
+            std::string s(size, '\0');
+            if (auto && r = read_all(fd, s.data(), s.size()); !r) {
+                return tl::unexpected(r.error());
+            }
+            return s;
+        }
+
+        tl::expected<std::vector<std::string>, std::string> get_list(int fd) {
+            const uint32_t size = CPS_TRY(get_u32(fd));
+            if (size > max_length) {
+                return tl::unexpected("Message too large");
+            }
+            std::vector<std::string> list;
+            list.reserve(size);
+            for (uint32_t i = 0; i < size; ++i) {
+                list.emplace_back(CPS_TRY(get_string(fd)));
+            }
+            return list;
+        }
+
+        /// @brief A query, as sent by a client
+        struct Request {
+            std::string cwd;
+            /// @brief NAME=value for each variable in environment which is set
+            std::vector<std::string> env;
+            std::vector<std::string> args;
+        };
+
+        struct Response {
+            int status = 0;
+            std::string out;
+            std::string err;
+        };
+
+        tl::expected<Request, std::string> read_request(int fd) {
+            Request req{};
+            req.cwd = CPS_TRY(get_string(fd));
+            req.env = CPS_TRY(get_list(fd));
+            req.args = CPS_TRY(get_list(fd));
+            return req;
+        }
+
+        tl::expected<void, std::string> write_response(int fd, const Response & resp) {
+            std::string buf;
+            put(buf, static_cast<uint32_t>(resp.status));
+            put(buf, resp.out);
+            put(buf, resp.err);
+            return write_all(fd, buf);
+        }
+
+        /// @brief Where to search for a client, from its environment and working directory
+        cps::search::Options client_options(const Request & req) {
+            std::unordered_map<std::string, std::string> values;
+            for (auto && e : req.env) {
+                if (const size_t eq = e.find('='); eq != std::string::npos) {
+                    values.insert_or_assign(e.substr(0, eq), e.substr(eq + 1));
+                }
+            }
+            cps::search::Options options = cps::search::environment([&values](const char * name) -> const char * {
+                auto && found = values.find(name);
+                return found == values.end() ? nullptr : found->second.c_str();
+            });
+
+            // Relative paths are relative to the client
+            const fs::path cwd{req.cwd};
+            for (auto && prefix : options.prefixes) {
+                prefix = cwd / prefix;
+            }
+            if (options.index) {
+                options.index = cwd / options.index.value();
+            }
+            return options;
+        }
+
+        /// @brief Identifies a set of options, for sharing a context between queries which use the same ones
+        std::string options_key(const cps::search::Options & options) {
+            std::string key;
+            for (auto && prefix : options.prefixes) {
+                key.append(prefix.string());
+                key.push_back('\0');
+            }
+            key.push_back('\0');
+            key.append(options.index.value_or(fs::path{}).string());
+            return key;
+        }
+
+        /// @brief The output of a query, and what it was computed from
+        struct CachedResult {
+            Response response;
+            /// @brief Stamps of the search directories and index file
+            std::vector<Stamp> world;
+            /// @brief Every CPS file read, and its stamp when it was read
+            std::vector<std::pair<fs::path, Stamp>> files;
+        };
+
+        struct CachedPackage {
+            Stamp stamp;
+            cps::loader::Package package;
+        };
+
+        /// @brief A search context, and the stamps of what it was read from
+        struct CachedContext {
+            std::vector<Stamp> world;
+            std::shared_ptr<const cps::search::Context> context;
+        };
+
+        /// @brief Everything kept between queries, which any number of queries may use at once
+        class Server {
+          public:
+            Server(const Handler & handler_) : handler{handler_} {};
+
+            Response query(const Request & req);
+
+          private:
+            /// @brief The context to search with some options
+            /// @param world The stamps of what the options point at now
+            std::shared_ptr<const cps::search::Context> context(const cps::search::Options & options,
+                                                                const std::vector<Stamp> & world);
+
+            const Handler & handler;
+            /// @brief Guards the caches
+            std::mutex lock;
+            LruMap<CachedContext> contexts{max_contexts};
+            LruMap<CachedPackage> packages{max_packages};
+            LruMap<CachedResult> results{max_results};
+            /// @brief Held exclusively by a query whose statistics or trace,
+            ///        which are of the whole process, must only describe its own work
+            std::shared_mutex exclusive;
+        };
+
+        std::shared_ptr<const cps::search::Context> Server::context(const cps::search::Options & options,
+                                                                    const std::vector<Stamp> & world) {
+            // The search context holds the contents of the search directories
+            // and the index. If any of them have changed since it was read
+            // they have to be read again.
+            const std::string key = options_key(options);
+            {
+                const std::lock_guard<std::mutex> guard{lock};
+                if (const CachedContext * hit = contexts.find(key); hit != nullptr && hit->world == world) {
+                    return hit->context;
+                }
+            }
+            // Other queries carry on while it is read. If two queries both
+            // read it, the last one read is kept.
+            auto && fresh = std::make_shared<const cps::search::Context>(options);
+            const std::lock_guard<std::mutex> guard{lock};
+            contexts.insert_or_assign(key, CachedContext{world, fresh});
+            return fresh;
+        }
+
+        Response Server::query(const Request & req) {
+            const char * trace = std::getenv("CPS_CONFIG_TRACE");
+            const bool alone = (trace != nullptr && trace[0] != '\0') ||
+                               std::any_of(req.args.begin(), req.args.end(), [](std::string_view a) {
+                                   return a == "--stats" || a.substr(0, 7) == "--trace";
+                               });
+            std::shared_lock<std::shared_mutex> shared{exclusive, std::defer_lock};
+            std::unique_lock<std::shared_mutex> sole{exclusive, std::defer_lock};
+            if (alone) {
+                sole.lock();
+            } else {
+                shared.lock();
+            }
+
+            Scope scope{req.cwd, client_options(req), nullptr};
+            std::vector<Stamp> world = inputs::world(scope.options);
+
+            std::string key = req.cwd;
+            for (const std::vector<std::string> * list : {&req.env, &req.args}) {
+                key.push_back('\0');
+                for (auto && s : *list) {
+                    key.append(s);
+                    key.push_back('\0');
+                }
+            }
+
+            // The files are stamped without holding the lock
+            std::optional<CachedResult> cached;
+            {
+                const std::lock_guard<std::mutex> guard{lock};
+                if (const CachedResult * hit = results.find(key)) {
+                    cached = *hit;
+                }
+            }
+            if (cached && cached->world == world &&
+                std::all_of(cached->files.begin(), cached->files.end(),
+                            [](auto && f) { return stamp(f.first) == f.second; })) {
+                return cached->response;
+            }
+
+            CachedResult entry{};
+            entry.world = std::move(world);
+            // Packages may be loaded on several threads, but only the
+            // bookkeeping needs a lock
+            std::mutex files_lock;
+            const cps::search::Loader load = [&](const fs::path & path) {
+                const Stamp st = stamp(path);
+                {
+                    const std::lock_guard<std::mutex> guard{files_lock};
+                    entry.files.emplace_back(path, st);
+                }
+                {
+                    const std::lock_guard<std::mutex> guard{lock};
+                    if (const CachedPackage * hit = packages.find(path.string()); hit != nullptr && hit->stamp == st) {
+                        ++cps::stats::counters.package_cache_hits;
+                        return tl::expected<cps::loader::Package, std::string>{hit->package};
+                    }
+                }
+                ++cps::stats::counters.package_cache_misses;
+                auto && p = cps::loader::load(path);
+                if (p) {
+                    const std::lock_guard<std::mutex> guard{lock};
+                    packages.insert_or_assign(path.string(), CachedPackage{st, p.value()});
+                }
+                return p;
+            };
+
+            Response & resp = entry.response;
+            try {
+                const std::shared_ptr<const cps::search::Context> ctx = context(scope.options, entry.world);
+                scope.context = ctx.get();
+                resp.status = handler(req.args, resp.out, resp.err, scope, load);
+            } catch (const std::exception & e) {
+                // Don't let one bad command line take the daemon down
+                return Response{1, "", fmt::format("{}\n", e.what())};
+            }
+
+            // Building the index or compiling has to happen every time it is
+            // asked for, and statistics describe the work done for this query
+            if (std::find_if(req.args.begin(), req.args.end(), [](std::string_view a) {
+                    return a == "--build-index" || a == "--stats" || a.substr(0, 9) == "--compile";
+                }) != req.args.end()) {
+                return resp;
+            }
+            Response answer = resp;
+            const std::lock_guard<std::mutex> guard{lock};
+            results.insert_or_assign(key, std::move(entry));
+            return answer;
+        }
+
+        /// @brief Whether the other end of a connection is run by the same user
+        bool same_user(int fd) {
+#ifdef SO_PEERCRED
+            ucred cred{};
+            socklen_t len = sizeof cred;
+            if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+                return false;
+            }
+            return cred.uid == ::getuid();
+#else
+            // Rely on the socket being in a directory only this user can access
+            (void)fd;
+            return true;
+#endif
+        }
+
+        /// @brief The directory used when neither $CPS_CONFIG_SOCKET nor $XDG_RUNTIME_DIR are set
+        fs::path fallback_dir() { return fmt::format("/tmp/cps-config-{}", ::getuid()); }
+
+        /// @brief Check that a directory in a shared location belongs to this user alone
+        tl::expected<void, std::string> check_private_dir(const fs::path & dir) {
+            struct stat st;
+            if (::lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != ::getuid() ||
+                (st.st_mode & 0077) != 0) {
+                return tl::unexpected(fmt::format("{} is not a directory private to this user", dir.string()));
+            }
+            return {};
+        }
+
+        /// @brief Answers connections on a fixed number of threads
+        class Workers {
+          public:
+            Workers(Server & server_) : server{server_} {
+                for (size_t i = 0; i < worker_count; ++i) {
+                    threads.emplace_back([this]() { work(); });
+                }
+            }
+            Workers(const Workers &) = delete;
+            Workers & operator=(const Workers &) = delete;
+            ~Workers() {
+                {
+                    const std::lock_guard<std::mutex> guard{lock};
+                    stopping = true;
+                }
+                ready.notify_all();
+                for (auto && t : threads) {
+                    t.join();
+                }
+                for (const int fd : pending) {
+                    ::close(fd);
+                }
+            }
+
+            /// @brief Queue a connection to be answered, which is closed once it has been
+            void add(int fd) {
+                {
+                    const std::lock_guard<std::mutex> guard{lock};
+                    if (pending.size() < max_pending) {
+                        pending.push_back(fd);
+                        fd = -1;
+                    }
+                }
+                if (fd >= 0) {
+                    ::close(fd);
+                    return;
+                }
+                ready.notify_one();
+            }
+
+          private:
+            void work() {
+                while (true) {
+                    int fd;
+                    {
+                        std::unique_lock<std::mutex> guard{lock};
+                        ready.wait(guard, [this]() { return stopping || !pending.empty(); });
+                        if (stopping) {
+                            return;
+                        }
+                        fd = pending.front();
+                        pending.pop_front();
+                    }
+                    answer(fd);
+                }
+            }
+
+            void answer(int fd) {
+                const Socket conn{fd};
+                if (!same_user(conn.fd) || !set_timeout(conn.fd, request_timeout)) {
+                    return;
+                }
+                auto && req = read_request(conn.fd);
+                if (!req) {
+                    return;
+                }
+                // There is nobody to report a failure to send the answer to
+                (void)write_response(conn.fd, server.query(req.value()));
+            }
+
+            Server & server;
+            std::mutex lock;
+            std::condition_variable ready;
+            std::deque<int> pending;
+            std::vector<std::thread> threads;
+            bool stopping = false;
+        };
+
+    } // namespace
+
+    Scope local_scope() { return Scope{fs::path{}, cps::search::environment(), nullptr}; }
+
+    fs::path socket_path() {
+        if (const char * env = std::getenv("CPS_CONFIG_SOCKET"); env && env[0] != '\0') {
+            return env;
+        }
+        if (const char * env = std::getenv("XDG_RUNTIME_DIR"); env && env[0] != '\0') {
+            return fs::path{env} / "cps-config.sock";
+        }
+        return fallback_dir() / "daemon.sock";
+    }
+
+    tl::expected<void, std::string> serve(const fs::path & path, const Handler & handler) {
+        sockaddr_un addr = address(path);
+        if (path.string().size() >= sizeof(addr.sun_path)) {
+            return tl::unexpected(fmt::format("Socket path {} is too long", path.string()));
+        }
+        // Anyone can create directories in /tmp, so make sure nobody else
+        // created this one first
+        if (path.parent_path() == fallback_dir()) {
+            if (::mkdir(fallback_dir().c_str(), 0700) != 0 && errno != EEXIST) {
+                return tl::unexpected(
+                    fmt::format("Could not create {}: {}", fallback_dir().string(), std::strerror(errno)));
+            }
+            if (auto && r = check_private_dir(fallback_dir()); !r) {
+                return r;
+            }
+        }
+
+        const Socket listener{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+        if (listener.fd < 0) {
+            return tl::unexpected(fmt::format("Could not create socket: {}", std::strerror(errno)));
+        }
+
+        // A socket left behind by a daemon which has exited can be replaced,
+        // but one that is still being served cannot
+        if (fs::exists(fs::symlink_status(path))) {
+            const Socket probe{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+            if (::connect(probe.fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr) == 0) {
+                return tl::unexpected(fmt::format("A daemon is already listening on {}", path.string()));
+            }
+            ::unlink(path.c_str());
+        }
+
+        // Only this user may connect
+        const mode_t old_mask = ::umask(0077);
+        const int bound = ::bind(listener.fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr);
+        ::umask(old_mask);
+        if (bound != 0) {
+            return tl::unexpected(fmt::format("Could not bind to {}: {}", path.string(), std::strerror(errno)));
+        }
+        if (::listen(listener.fd, SOMAXCONN) != 0) {
+            return tl::unexpected(fmt::format("Could not listen on {}: {}", path.string(), std::strerror(errno)));
+        }
+
+        // A client going away before reading its answer must not kill us
+        std::signal(SIGPIPE, SIG_IGN);
+
+        // Connections are only accepted here, reading the query and
+        // answering it is left to the workers
+        Server server{handler};
+        Workers workers{server};
+        while (true) {
+            const int fd = ::accept4(listener.fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                return tl::unexpected(fmt::format("Could not accept connection: {}", std::strerror(errno)));
+            }
+            workers.add(fd);
+        }
+    }
+
+    tl::expected<int, std::string> forward(const fs::path & path, const std::vector<std::string> & args,
+                                           std::string & out, std::string & err) {
+        const sockaddr_un addr = address(path);
+        const Socket conn{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+        if (conn.fd < 0) {
+            return tl::unexpected(fmt::format("Could not create socket: {}", std::strerror(errno)));
+        }
+        // A daemon which is stuck, or busy with other clients, is treated
+        // the same as no daemon at all
+        if (auto && r = set_timeout(conn.fd, answer_timeout); !r) {
+            return tl::unexpected(r.error());
+        }
+        if (::connect(conn.fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr) != 0) {
+            return tl::unexpected(fmt::format("Could not connect to {}: {}", path.string(), std::strerror(errno)));
+        }
+        // The flags we are about to print must come from a daemon we trust
+        if (!same_user(conn.fd)) {
+            return tl::unexpected(fmt::format("{} is served by another user", path.string()));
+        }
+
+        std::error_code ec;
+        const fs::path cwd = fs::current_path(ec);
+        if (ec) {
+            return tl::unexpected(fmt::format("Could not get the current directory: {}", ec.message()));
+        }
+        std::string buf;
+        put(buf, cwd.string());
+        put(buf, inputs::current_environment());
+        put(buf, args);
+        if (auto && r = write_all(conn.fd, buf); !r) {
+            return tl::unexpected(r.error());
+        }
+
+        const int status = static_cast<int>(CPS_TRY(get_u32(conn.fd)));
+        out = CPS_TRY(get_string(conn.fd));
+        err = CPS_TRY(get_string(conn.fd));
+        return status;
+    }
+
+} // namespace cps_config::daemon
@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include "cps/search.hpp"
+
+#include <tl/expected.hpp>
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace cps_config::daemon {
+
+    /// @brief Where a query is answered from, which need not be this process's environment
+    struct Scope {
+        /// @brief Relative paths on the command line are relative to this
+        std::filesystem::path cwd;
+        /// @brief Where to search, and the index to use or build
+        cps::search::Options options;
+        /// @brief The packages to search, or nullptr to read them according to options
+        const cps::search::Context * context = nullptr;
+    };
+
+    /// @brief The scope of a query answered by this process on its own behalf
+    Scope local_scope();
+
+    /// @brief Answer one query
+    /// @param args The full command line, including argv[0]
+    /// @param out What would have been written to stdout
+    /// @param err What would have been written to stderr
+    /// @param load Used to read every CPS file the query needs
+    /// @return The exit status
+    using Handler = std::function<int(const std::vector<std::string> & args, std::string & out, std::string & err,
+                                      const Scope & scope, const cps::search::Loader & load)>;
+
+    /// @brief The socket the daemon listens on
+    ///
+    /// This is $CPS_CONFIG_SOCKET if set, otherwise cps-config.sock in
+    /// $XDG_RUNTIME_DIR, otherwise a directory in /tmp only the current user
+    /// can access.
+    std::filesystem::path socket_path();
+
+    /// @brief Serve queries on a Unix socket until killed
+    ///
+    /// Queries are answered concurrently, each in the working directory and
+    /// environment of the client that sent it, without changing those of the
+    /// daemon. Loaded CPS files and the output of each query are kept between
+    /// queries, up to a fixed number of each. Each is checked against the
+    /// filesystem before it is reused, so an installed, removed or modified
+    /// CPS file is picked up by the next query. A client which doesn't send
+    /// its query or read its answer promptly is dropped.
+    tl::expected<void, std::string> serve(const std::filesystem::path & path, const Handler & handler);
+
+    /// @brief Have a daemon answer a query
+    /// @param args The full command line, including argv[0]
+    /// @return The exit status of the query, or an error if no daemon answered it in time
+    tl::expected<int, std::string> forward(const std::filesystem::path & path, const std::vector<std::string> & args,
+                                           std::string & out, std::string & err);
+
+} // namespace cps_config::daemon
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "heap.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace cps_config::heap {
+
+    namespace {
+
+        /// @brief Written in front of every block, so that freeing one only
+        ///        undoes what allocating it added
+        ///
+        /// Padded to the alignment malloc guarantees, so the block after it
+        /// keeps that alignment.
+        struct alignas(std::max_align_t) Header {
+            /// @brief The bytes counted for this block, 0 if none were
+            uint64_t size;
+            /// @brief Which call to start() the block was counted after
+            uint64_t generation;
+        };
+
+        std::atomic<bool> active{false};
+        std::atomic<uint64_t> generation{0};
+        std::atomic<int64_t> live{0};
+        std::atomic<int64_t> high{0};
+
+        void * allocate(size_t size) noexcept {
+            auto * h = static_cast<Header *>(std::malloc(sizeof(Header) + size));
+            if (h == nullptr) {
+                return nullptr;
+            }
+            h->size = 0;
+            if (tracking()) {
+                h->size = size;
+                h->generation = generation.load(std::memory_order_relaxed);
+                const auto bytes = static_cast<int64_t>(size);
+                const int64_t now = live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+                int64_t prev = high.load(std::memory_order_relaxed);
+                while (now > prev && !high.compare_exchange_weak(prev, now, std::memory_order_relaxed)) {
+                }
+            }
+            return h + 1;
+        }
+
+        void deallocate(void * p) noexcept {
+            if (p == nullptr) {
+                return;
+            }
+            auto * h = static_cast<Header *>(p) - 1;
+            // Blocks counted before the last start() were reset along with
+            // everything else, and subtracting them would understate the peak
+            if (h->size != 0 && h->generation == generation.load(std::memory_order_relaxed)) {
+                live.fetch_sub(static_cast<int64_t>(h->size), std::memory_order_relaxed);
+            }
+            std::free(h);
+        }
+
+    } // namespace
+
+    void start() {
+        generation.fetch_add(1, std::memory_order_relaxed);
+        live = 0;
+        high = 0;
+        active = true;
+    }
+
+    void stop() { active = false; }
+
+    bool tracking() { return active.load(std::memory_order_relaxed); }
+
+    uint64_t peak() { return static_cast<uint64_t>(std::max<int64_t>(high, 0)); }
+
+} // namespace cps_config::heap
+
+// Every form is replaced, as a block must be freed by the same header-aware
+// code that allocated it. The over-aligned forms are left alone, since the
+// standard library pairs them with each other and not with these.
+void * operator new(size_t size) {
+    void * p = cps_config::heap::allocate(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc{};
+    }
+    return p;
+}
+
+void * operator new[](size_t size) { return operator new(size); }
+
+void * operator new(size_t size, const std::nothrow_t &) noexcept {
+    return cps_config::heap::allocate(size == 0 ? 1 : size);
+}
+
+void * operator new[](size_t size, const std::nothrow_t & tag) noexcept { return operator new(size, tag); }
+
+void operator delete(void * p) noexcept { cps_config::heap::deallocate(p); }
+void operator delete[](void * p) noexcept { cps_config::heap::deallocate(p); }
+void operator delete(void * p, size_t) noexcept { cps_config::heap::deallocate(p); }
+void operator delete[](void * p, size_t) noexcept { cps_config::heap::deallocate(p); }
+void operator delete(void * p, const std::nothrow_t &) noexcept { cps_config::heap::deallocate(p); }
+void operator delete[](void * p, const std::nothrow_t &) noexcept { cps_config::heap::deallocate(p); }
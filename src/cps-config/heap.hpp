@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include <cstdint>
+
+namespace cps_config::heap {
+
+    /// @brief Start measuring the memory allocated with operator new
+    ///
+    /// Every block carries a small header either way, and until this is
+    /// called counting it costs one extra branch.
+    void start();
+
+    /// @brief Stop measuring
+    void stop();
+
+    /// @brief Whether memory is being measured
+    bool tracking();
+
+    /// @brief The most memory held at once since start() was called
+    ///
+    /// Only the bytes asked for are counted. Memory allocated before start()
+    /// is not counted when allocated, nor subtracted when freed.
+    uint64_t peak();
+
+} // namespace cps_config::heap
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "inputs.hpp"
+
+#include "cps/search.hpp"
+#include "cps/stats.hpp"
+
+#include <fmt/format.h>
+
+#include <sys/stat.h>
+
+#include <cstdlib>
+
+namespace fs = std::filesystem;
+
+namespace cps_config::inputs {
+
+    const std::vector<std::string> environment{"CPS_PATH", "CPS_INDEX", "XDG_CACHE_HOME", "HOME"};
+
+    std::vector<std::string> current_environment() {
+        std::vector<std::string> env;
+        for (auto && name : environment) {
+            if (const char * value = std::getenv(name.c_str())) {
+                env.emplace_back(fmt::format("{}={}", name, value));
+            }
+        }
+        return env;
+    }
+
+    uint64_t hash(std::string_view s) {
+        uint64_t h = 0xcbf29ce484222325;
+        for (const char c : s) {
+            h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+        }
+        return h;
+    }
+
+    Stamp stamp(const fs::path & path) {
+        struct stat st;
+        ++cps::stats::counters.files_stated;
+        if (::stat(path.c_str(), &st) != 0) {
+            return Stamp{};
+        }
+        return Stamp{true, static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+                     static_cast<int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec,
+                     static_cast<uint64_t>(st.st_ino), static_cast<int64_t>(st.st_size)};
+    }
+
+    std::vector<Stamp> world(const cps::search::Options & options) {
+        std::vector<Stamp> stamps;
+        for (auto && dir : options.directories()) {
+            stamps.emplace_back(stamp(dir));
+        }
+        if (options.index) {
+            stamps.emplace_back(stamp(options.index.value()));
+        }
+        return stamps;
+    }
+
+} // namespace cps_config::inputs
@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include "cps/search.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cps_config::inputs {
+
+    /// @brief Environment variables which can change the result of a query
+    extern const std::vector<std::string> environment;
+
+    /// @brief NAME=value for each variable in environment which is set
+    std::vector<std::string> current_environment();
+
+    /// @brief FNV-1a, which unlike std::hash is the same in every build
+    uint64_t hash(std::string_view s);
+
+    /// @brief Enough of a file's metadata to tell whether it has changed
+    struct Stamp {
+        bool exists = false;
+        int64_t mtime = 0;
+        int64_t ctime = 0;
+        uint64_t inode = 0;
+        int64_t size = 0;
+
+        bool operator==(const Stamp & o) const {
+            return exists == o.exists && mtime == o.mtime && ctime == o.ctime && inode == o.inode && size == o.size;
+        }
+        bool operator!=(const Stamp & o) const { return !(*this == o); }
+    };
+
+    Stamp stamp(const std::filesystem::path & path);
+
+    /// @brief Stamps of the search directories and the index file
+    ///
+    /// Installing or removing a CPS file changes one of these, as does
+    /// building a new index.
+    std::vector<Stamp> world(const cps::search::Options & options);
+
+} // namespace cps_config::inputs
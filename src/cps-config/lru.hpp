@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace cps_config {
+
+    /// @brief A map which forgets the least recently used entry once it holds too many
+    template <typename V> class LruMap {
+      public:
+        explicit LruMap(size_t capacity_) : capacity{capacity_} {};
+
+        /// @brief Find an entry, which becomes the most recently used
+        /// @return The value, or nullptr if there is no entry for the key
+        V * find(const std::string & key) {
+            auto && hit = index.find(key);
+            if (hit == index.end()) {
+                return nullptr;
+            }
+            order.splice(order.begin(), order, hit->second);
+            return &hit->second->second;
+        }
+
+        /// @brief Add or replace an entry, which becomes the most recently used
+        V & insert_or_assign(const std::string & key, V value) {
+            if (V * existing = find(key)) {
+                *existing = std::move(value);
+                return *existing;
+            }
+            order.emplace_front(key, std::move(value));
+            index.emplace(key, order.begin());
+            if (order.size() > capacity) {
+                index.erase(order.back().first);
+                order.pop_back();
+            }
+            return order.front().second;
+        }
+
+        void erase(const std::string & key) {
+            if (auto && hit = index.find(key); hit != index.end()) {
+                order.erase(hit->second);
+                index.erase(hit);
+            }
+        }
+
+      private:
+        const size_t capacity;
+        /// @brief Most recently used first
+        std::list<std::pair<std::string, V>> order;
+        std::unordered_map<std::string, typename std::list<std::pair<std::string, V>>::iterator> index;
+    };
+
+} // namespace cps_config
@@ -2,25 +2,99 @@
 // Copyright © 2024 Bret Brown
 // SPDX-License-Identifier: MIT
 
+#include "cache.hpp"
+#include "daemon.hpp"
+#include "heap.hpp"
+#include "lru.hpp"
+#include "shared.hpp"
+
 #include "cps/config.hpp"
+#include "cps/error.hpp"
+#include "cps/json.hpp"
 #include "cps/printer.hpp"
 #include "cps/search.hpp"
+#include "cps/stats.hpp"
+#include "cps/trace.hpp"
 
 #include <cxxopts.hpp>
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace cps_config {
-    int run(int argc, char * argv[]) {
+    int batch(const std::string & program, const cps::search::Options & search_options);
+
+    /// @brief Upper bound on the number of answers a batch remembers
+    constexpr size_t max_batch_answers = 4096;
+
+    /// @brief Records a trace while alive, and writes it to a file when destroyed
+    class TraceFile {
+      public:
+        TraceFile(std::filesystem::path f, std::string & e) : file{std::move(f)}, err{e} { cps::trace::start(); }
+        ~TraceFile() {
+            if (auto && r = cps::trace::stop(file); !r) {
+                err += fmt::format("{}\n", r.error());
+            }
+        }
+        TraceFile(const TraceFile &) = delete;
+        TraceFile & operator=(const TraceFile &) = delete;
+
+      private:
+        const std::filesystem::path file;
+        std::string & err;
+    };
+
+    /// @brief Counts the work done while alive, and reports it when destroyed
+    class StatsReport {
+      public:
+        StatsReport(std::string & e) : err{e} {
+            cps::stats::reset();
+            heap::start();
+        }
+        ~StatsReport() {
+            heap::stop();
+            err += cps::stats::format(cps::stats::counters);
+            err += fmt::format("{:<24}{}\n", "peak heap bytes", heap::peak());
+        }
+        StatsReport(const StatsReport &) = delete;
+        StatsReport & operator=(const StatsReport &) = delete;
+
+      private:
+        std::string & err;
+    };
+
+    /// @brief The file to write a trace to, from --trace or $CPS_CONFIG_TRACE
+    std::optional<std::string> trace_file(const cxxopts::ParseResult & parsed_options) {
+        if (parsed_options.count("trace")) {
+            return parsed_options["trace"].as<std::string>();
+        }
+        if (const char * env = std::getenv("CPS_CONFIG_TRACE"); env != nullptr && env[0] != '\0') {
+            return std::string{env};
+        }
+        return std::nullopt;
+    }
+
+    int run(const std::vector<std::string> & args, std::string & out, std::string & err, const daemon::Scope & scope,
+            const cps::search::Loader & load) {
         using namespace std::string_literals;
 
         cps::printer::Config conf{};
         std::vector<std::string> components;
         std::string format{"pkgconf"};
-        std::string package_name;
+        std::vector<std::string> package_names;
 
         static auto const description = R"(cps-config is a utility for querying and using installed libraries.
 
@@ -41,7 +115,7 @@ Support:
         cxxopts::Options options("cps-config", description);
         // clang-format off
         options.add_options()
-            ("package", "search for the specified package", cxxopts::value<std::string>())
+            ("package", "search for the specified packages", cxxopts::value<std::vector<std::string>>())
             ("cflags", "output all pre-processor and compiler flags")
             ("cflags-only-I", "output -I flags")
             ("cflags-only-other", "output cflags not covered by the cflags-only-I option")
@@ -51,26 +125,98 @@ Support:
             ("modversion", "print the specified module's version to stdout")
             ("component", "look for the specified component", cxxopts::value<std::vector<std::string>>())
             ("format", "output format", cxxopts::value<std::string>())
+            ("build-index", "scan the search paths and write an index of the CPS files found")
+            ("compile", "compile the CPS files given instead of packages, into a binary cache read instead of the JSON")
+            ("compile-all", "compile every CPS file in the search paths, before building the index")
+            ("daemon", "answer queries from other cps-config processes, which use it when CPS_CONFIG_DAEMON is set")
+            ("batch", "answer queries read from stdin, one per line, either as arguments or a JSON array of them")
+            ("trace", "write a Chrome trace of where the time goes to the given file, or set CPS_CONFIG_TRACE",
+             cxxopts::value<std::string>())
+            ("stats", "print counts of the work done to stderr")
             ("v,version", "print cps-config version")
             ("h,help", "print usage");
         // clang-format on
         options.parse_positional({"package"});
         options.positional_help("<packages>");
-        auto parsed_options = options.parse(argc, argv);
+        std::vector<const char *> argv;
+        argv.reserve(args.size());
+        std::transform(args.begin(), args.end(), std::back_inserter(argv), [](auto && a) { return a.c_str(); });
+        auto parsed_options = options.parse(static_cast<int>(argv.size()), argv.data());
 
         if (parsed_options.count("help")) {
-            fmt::print("{}\n", options.help());
+            out += fmt::format("{}\n", options.help());
             return 0;
         }
         if (parsed_options.count("version")) {
-            fmt::print("{}\n", CPS_VERSION);
+            out += fmt::format("{}\n", CPS_VERSION);
             return 0;
         }
 
+        // A daemon traces each query on its own, and in a batch the trace
+        // covers every query
+        std::optional<TraceFile> tracing;
+        if (auto && file = trace_file(parsed_options); file && !parsed_options.count("daemon")) {
+            if (!cps::trace::enabled()) {
+                tracing.emplace(file.value(), err);
+            }
+        }
+        // Likewise, the statistics of a batch cover every query
+        std::optional<StatsReport> stats;
+        if (parsed_options.count("stats") && !parsed_options.count("daemon") && !heap::tracking()) {
+            stats.emplace(err);
+        }
+
+        if (parsed_options.count("build-index")) {
+            if (!scope.options.index) {
+                err += "Nowhere to write the index, set CPS_INDEX, XDG_CACHE_HOME or HOME\n";
+                return 1;
+            }
+            if (auto && r = cps::search::build_index(scope.options, scope.options.index.value()); !r) {
+                err += fmt::format("{}\n", r.error());
+                return 1;
+            }
+            return 0;
+        }
+
+        if (parsed_options.count("compile")) {
+            if (!parsed_options.count("package")) {
+                err += "Expected a CPS file to be specified\n";
+                return 1;
+            }
+            int status = 0;
+            for (auto && file : parsed_options["package"].as<std::vector<std::string>>()) {
+                if (auto && r = cps::loader::compile(scope.cwd / file); !r) {
+                    err += fmt::format("{}\n", r.error());
+                    status = 1;
+                }
+            }
+            return status;
+        }
+
+        if (parsed_options.count("compile-all")) {
+            if (auto && r = cps::search::compile_all(scope.options); !r) {
+                err += fmt::format("{}\n", r.error());
+                return 1;
+            }
+            return 0;
+        }
+
+        if (parsed_options.count("daemon")) {
+            if (auto && r = daemon::serve(daemon::socket_path(), run); !r) {
+                err += fmt::format("{}\n", r.error());
+                return 1;
+            }
+            return 0;
+        }
+
+        if (parsed_options.count("batch")) {
+            return batch(args[0], scope.options);
+        }
+
         if (parsed_options.count("package")) {
-            package_name = parsed_options["package"].as<std::string>();
+            package_names = parsed_options["package"].as<std::vector<std::string>>();
         } else {
-            fmt::print(stderr, "Expected a package name to be specified\n");
+            err += "Expected a package name to be specified\n";
             return 1;
         }
 
@@ -110,21 +256,225 @@ Support:
             format = parsed_options["format"].as<std::string>();
         }
 
-        auto && p = cps::search::find_package(package_name, components, components.empty());
+        const cps::search::Context * context = scope.context;
+        std::optional<cps::search::Context> own_context;
+        if (context == nullptr) {
+            context = &own_context.emplace(scope.options);
+        }
+        auto && p = cps::search::find_packages(*context, package_names, components, components.empty(), load);
         if (!p) {
-            fmt::print("{}\n", p.error());
+            out += fmt::format("{}\n", p.error());
             return 1;
         }
         auto && result = p.value();
 
         if (format == "pkgconf") {
-            return cps::printer::pkgconf(result, conf);
+            return cps::printer::pkgconf(result, conf, out);
             return 0;
         }
 
-        fmt::print(stderr, "Unknown mode {}\n", format);
+        err += fmt::format("Unknown mode {}\n", format);
         return 1;
     }
+
+    /// @brief The arguments of a query in a batch, from one line
+    ///
+    /// A line starting with [ is a JSON array of strings, so that arguments
+    /// can hold spaces or anything else. Otherwise the line is split on
+    /// whitespace.
+    tl::expected<std::vector<std::string>, std::string> batch_args(std::string_view line) {
+        std::vector<std::string> args;
+        const size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string_view::npos || line[first] != '[') {
+            std::istringstream words{std::string{line}};
+            for (std::string w; words >> w;) {
+                args.emplace_back(std::move(w));
+            }
+            return args;
+        }
+
+        cps::json::Reader reader{line};
+        CPS_TRY(reader.enter());
+        while (CPS_TRY(reader.next_element())) {
+            args.emplace_back(CPS_TRY(reader.string()));
+        }
+        if (!reader.at_end()) {
+            return tl::unexpected("Expected nothing after the JSON array");
+        }
+        return args;
+    }
+
+    /// @brief Why an argument can't be used in a batch, if it can't
+    std::optional<std::string_view> batch_forbidden(std::string_view arg) {
+        // Each of these either does more than answer the query, so repeating
+        // it from memory would be wrong, or is already covered by the batch
+        for (const std::string_view option : {"--batch", "--daemon", "--build-index", "--compile", "--compile-all",
+                                              "--trace"}) {
+            if (arg == option || (arg.substr(0, option.size()) == option && arg[option.size()] == '=')) {
+                return option;
+            }
+        }
+        return std::nullopt;
+    }
+
+    /// @brief Answer queries read from stdin until it is closed
+    ///
+    /// Each line holds the arguments of one query, see batch_args. Exactly
+    /// one line is written to stdout for each line read, which is empty if
+    /// the query failed, in which case the error is written to stderr along
+    /// with the line number. An answer which would take more than one line,
+    /// such as --help, is an error. Output is flushed after each query so
+    /// that the caller can wait for an answer before asking the next
+    /// question.
+    int batch(const std::string & program, const cps::search::Options & search_options) {
+        // Every query shares one search context and the CPS files loaded so
+        // far, and a query which has already been asked recently is answered
+        // from memory
+        const cps::search::Context context{search_options};
+        const daemon::Scope scope{std::filesystem::path{}, search_options, &context};
+        std::unordered_map<std::string, cps::loader::Package> packages;
+        std::mutex packages_lock;
+        const cps::search::Loader load = [&packages, &packages_lock](
+                                             const std::filesystem::path & path)
+            -> tl::expected<cps::loader::Package, std::string> {
+            {
+                const std::lock_guard<std::mutex> guard{packages_lock};
+                if (auto && hit = packages.find(path.string()); hit != packages.end()) {
+                    ++cps::stats::counters.package_cache_hits;
+                    return hit->second;
+                }
+            }
+            ++cps::stats::counters.package_cache_misses;
+            auto && p = cps::loader::load(path);
+            if (p) {
+                const std::lock_guard<std::mutex> guard{packages_lock};
+                packages.emplace(path.string(), p.value());
+            }
+            return p;
+        };
+
+        struct Answer {
+            int status = 0;
+            std::string out;
+            std::string err;
+        };
+        LruMap<Answer> answers{max_batch_answers};
+
+        int status = 0;
+        std::string line;
+        for (size_t lineno = 1; std::getline(std::cin, line); ++lineno) {
+            auto && parsed = batch_args(line);
+            if (parsed && parsed->empty()) {
+                fmt::print("\n");
+                std::fflush(stdout);
+                continue;
+            }
+
+            // The same query may be spelled in more than one way
+            std::string key;
+            if (parsed) {
+                for (auto && a : parsed.value()) {
+                    key.append(a);
+                    key.push_back('\0');
+                }
+            }
+
+            Answer a{};
+            if (!parsed) {
+                a = Answer{1, "", fmt::format("{}\n", parsed.error())};
+            } else if (const Answer * hit = answers.find(key)) {
+                a = *hit;
+            } else {
+                std::vector<std::string> args{program};
+                args.insert(args.end(), parsed->begin(), parsed->end());
+                std::optional<std::string_view> forbidden;
+                for (auto && arg : parsed.value()) {
+                    if ((forbidden = batch_forbidden(arg))) {
+                        break;
+                    }
+                }
+                if (forbidden) {
+                    a = Answer{1, "", fmt::format("{} cannot be used in a batch\n", forbidden.value())};
+                } else {
+                    // A bad command line only fails that query
+                    try {
+                        a.status = run(args, a.out, a.err, scope, load);
+                    } catch (const std::exception & e) {
+                        a = Answer{1, "", fmt::format("{}\n", e.what())};
+                    }
+                }
+                if (a.status == 0 && !a.out.empty() && a.out.back() == '\n') {
+                    a.out.pop_back();
+                }
+                if (a.status == 0 && a.out.find('\n') != std::string::npos) {
+                    a = Answer{1, "", "The answer takes more than one line, which a batch can't frame\n"};
+                }
+                answers.insert_or_assign(key, a);
+            }
+
+            if (a.status == 0) {
+                fmt::print("{}\n", a.out);
+            } else {
+                status = 1;
+                // Errors from finding a package are reported on stdout
+                std::string_view msg = a.err.empty() ? a.out : a.err;
+                if (!msg.empty() && msg.back() == '\n') {
+                    msg.remove_suffix(1);
+                }
+                fmt::print("\n");
+                fmt::print(stderr, "line {}: {}\n", lineno, msg);
+            }
+            std::fflush(stdout);
+        }
+
+        return status;
+    }
+
+    /// @brief Whether to try having a daemon answer this query
+    bool use_daemon(const std::vector<std::string> & args) {
+        const char * env = std::getenv("CPS_CONFIG_DAEMON");
+        if (env == nullptr || env[0] == '\0' || std::string_view{env} == "0") {
+            return false;
+        }
+        // None of these can be answered by another process
+        const char * trace = std::getenv("CPS_CONFIG_TRACE");
+        if (trace != nullptr && trace[0] != '\0') {
+            return false;
+        }
+        return std::find_if(args.begin(), args.end(), [](std::string_view a) {
+                   return a == "--daemon" || a == "--batch" || a.substr(0, 7) == "--trace";
+               }) == args.end();
+    }
 } // namespace cps_config
 
-int main(int argc, char * argv[]) { return cps_config::run(argc, argv); }
+int main(int argc, char * argv[]) {
+    const std::vector<std::string> args{argv, argv + argc};
+    std::string out;
+    std::string err;
+
+    std::optional<int> status;
+    if (cps_config::use_daemon(args)) {
+        // If no daemon is running, quietly answer the query ourselves
+        if (auto && r = cps_config::daemon::forward(cps_config::daemon::socket_path(), args, out, err)) {
+            status = r.value();
+        } else {
+            out.clear();
+            err.clear();
+        }
+    }
+    if (!status) {
+        cps::search::Loader load = [](const std::filesystem::path & path) { return cps::loader::load(path); };
+        if (auto && file = cps_config::shared::path()) {
+            load = cps_config::shared::loader(file.value(), std::move(load));
+        }
+        if (cps_config::cache::enabled(args)) {
+            status = cps_config::cache::answer(args, out, err, cps_config::run, load);
+        } else {
+            status = cps_config::run(args, out, err, cps_config::daemon::local_scope(), load);
+        }
+    }
+
+    fmt::print(stdout, "{}", out);
+    fmt::print(stderr, "{}", err);
+    return status.value();
+}
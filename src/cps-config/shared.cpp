@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "shared.hpp"
+
+#include "inputs.hpp"
+
+#include "cps/binary.hpp"
+#include "cps/stats.hpp"
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+namespace cps_config::shared {
+
+    namespace {
+
+        using inputs::Stamp;
+
+        // Every process that maps the file must agree on these without taking
+        // a lock, which only works if the atomics are the plain words they
+        // wrap
+        static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+        /// @brief The first bytes of the file, the last is bumped whenever the layout changes
+        constexpr char magic[8] = {'c', 'p', 's', '-', 's', 'h', 'm', '3'};
+
+        /// @brief The number of slots in the table
+        constexpr uint64_t slot_count = 8192;
+
+        /// @brief The number of slots after a package's home slot that it may be stored in
+        constexpr uint64_t max_probes = 8;
+
+        /// @brief The bytes available for records
+        ///
+        /// The file is sparse, so this only takes up as much disk as has been
+        /// written.
+        constexpr uint64_t data_size = 64 * 1024 * 1024;
+
+        /// @brief The part of the header which never changes once the file is created
+        struct Geometry {
+            char magic[8];
+            uint64_t slot_count;
+            uint64_t data_size;
+        };
+
+        struct Header {
+            Geometry geometry;
+            /// @brief The number of bytes of the data region handed out so far
+            std::atomic<uint64_t> tail;
+        };
+
+        /// @brief A cached package in the data region, followed by its path and then the package
+        ///
+        /// A record is written once, before any slot points at it, and never
+        /// changes afterwards. Records aren't aligned, so they are copied in
+        /// and out rather than used in place.
+        struct Record {
+            /// @brief The hash of the path of the CPS file
+            uint64_t hash;
+            uint64_t path_size;
+            uint64_t package_size;
+            /// @brief The stamp of the CPS file when it was loaded
+            int64_t mtime;
+            int64_t ctime;
+            uint64_t inode;
+            int64_t size;
+        };
+
+        /// @brief One more than the offset of a record in the data region, or zero if the slot has never been used
+        ///
+        /// Replacing a package only swaps which record its slot points at, so
+        /// a slot is never half written and nobody ever owns one. A writer
+        /// which dies at any point leaves, at worst, a record nothing points
+        /// at.
+        using Slot = std::atomic<uint64_t>;
+
+        /// @brief Slots start on their own cache line
+        constexpr uint64_t slots_offset = 64;
+        static_assert(sizeof(Header) <= slots_offset);
+
+        constexpr uint64_t data_offset = slots_offset + slot_count * sizeof(Slot);
+        constexpr uint64_t file_size = data_offset + data_size;
+
+        constexpr Geometry expected_geometry() {
+            Geometry g{{}, slot_count, data_size};
+            for (size_t i = 0; i < sizeof(magic); ++i) {
+                g.magic[i] = magic[i];
+            }
+            return g;
+        }
+
+        tl::unexpected<std::string> error(std::string_view what, const fs::path & file) {
+            return tl::unexpected(fmt::format("Could not {} shared cache {}: {}", what, file.string(),
+                                              std::strerror(errno)));
+        }
+
+        /// @brief Create an empty cache
+        /// @param replace Whether to replace the file if it exists, rather than keep it
+        tl::expected<void, std::string> create(const fs::path & file, bool replace) {
+            std::string tmp = file.string() + ".XXXXXX";
+            const int fd = ::mkstemp(tmp.data());
+            if (fd < 0) {
+                return error("create", file);
+            }
+            // Everything but the geometry starts as zero, and the file is only
+            // given its name once that has been written, so nobody ever maps a
+            // file which is half made
+            const Geometry g = expected_geometry();
+            const bool written = ::ftruncate(fd, file_size) == 0 && ::pwrite(fd, &g, sizeof(g), 0) == sizeof(g) &&
+                                 ::fchmod(fd, 0644) == 0;
+            ::close(fd);
+            if (!written) {
+                auto && e = error("create", file);
+                ::unlink(tmp.c_str());
+                return e;
+            }
+
+            // If another process creates it first, use theirs
+            const bool named = replace ? ::rename(tmp.c_str(), file.c_str()) == 0
+                                       : ::link(tmp.c_str(), file.c_str()) == 0 || errno == EEXIST;
+            if (!named) {
+                auto && e = error("create", file);
+                ::unlink(tmp.c_str());
+                return e;
+            }
+            if (!replace) {
+                ::unlink(tmp.c_str());
+            }
+            return {};
+        }
+
+        class Region {
+          public:
+            Region(fs::path file_, void * base_) : file{std::move(file_)}, base{static_cast<char *>(base_)} {};
+            Region(const Region &) = delete;
+            Region & operator=(const Region &) = delete;
+            ~Region() { ::munmap(base, file_size); }
+
+            /// @brief Map a cache into memory, creating it if needed
+            static tl::expected<std::shared_ptr<Region>, std::string> map(const fs::path & file) {
+                // Try twice, since a file which is damaged or from another
+                // version of cps-config is replaced with a new one
+                for (int attempt = 0; attempt < 2; ++attempt) {
+                    int fd = ::open(file.c_str(), O_RDWR | O_CLOEXEC);
+                    if (fd < 0 && errno == ENOENT) {
+                        if (auto && r = create(file, false); !r) {
+                            return tl::unexpected(r.error());
+                        }
+                        fd = ::open(file.c_str(), O_RDWR | O_CLOEXEC);
+                    }
+                    if (fd < 0) {
+                        return error("open", file);
+                    }
+
+                    struct stat st;
+                    if (::fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) == file_size) {
+                        void * base = ::mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                        ::close(fd);
+                        if (base == MAP_FAILED) {
+                            return error("map", file);
+                        }
+                        auto region = std::make_shared<Region>(file, base);
+                        const Geometry g = expected_geometry();
+                        if (std::memcmp(&region->header()->geometry, &g, sizeof(g)) == 0) {
+                            return region;
+                        }
+                    } else {
+                        ::close(fd);
+                    }
+
+                    if (auto && r = create(file, true); !r) {
+                        return tl::unexpected(r.error());
+                    }
+                }
+                return tl::unexpected(fmt::format("Could not use shared cache {}", file.string()));
+            }
+
+            /// @brief Find a cached package
+            /// @param current The stamp of the CPS file now, which must match the one it was cached with
+            /// @return The encoded package
+            std::optional<std::string_view> find(std::string_view path, const Stamp & current) const {
+                const uint64_t h = inputs::hash(path);
+                for (uint64_t i = 0; i < max_probes; ++i) {
+                    const uint64_t slot = slots()[(h + i) % slot_count].load(std::memory_order_acquire);
+                    if (slot == 0) {
+                        // Slots are filled in probe order, so nothing is further on
+                        return std::nullopt;
+                    }
+                    // The file may be damaged, so check the record fits before reading it
+                    const uint64_t offset = slot - 1;
+                    if (offset > data_size || sizeof(Record) > data_size - offset) {
+                        continue;
+                    }
+                    Record r;
+                    std::memcpy(&r, data() + offset, sizeof r);
+                    const uint64_t rest = data_size - offset - sizeof r;
+                    const Stamp cached{true, r.mtime, r.ctime, r.inode, r.size};
+                    if (r.hash != h || cached != current || r.path_size > rest ||
+                        r.package_size > rest - r.path_size) {
+                        continue;
+                    }
+                    const std::string_view blob{data() + offset + sizeof r, r.path_size + r.package_size};
+                    if (blob.substr(0, r.path_size) == path) {
+                        return blob.substr(r.path_size);
+                    }
+                }
+                return std::nullopt;
+            }
+
+            /// @brief Add a package to the cache, or replace an older copy of it
+            /// @param stamp The stamp of the CPS file before it was loaded
+            void publish(std::string_view path, const Stamp & stamp, std::string_view package) {
+                const uint64_t h = inputs::hash(path);
+                const Record r{h, path.size(), package.size(), stamp.mtime, stamp.ctime, stamp.inode, stamp.size};
+                const uint64_t need = sizeof r + path.size() + package.size();
+                const uint64_t offset = header()->tail.fetch_add(need, std::memory_order_relaxed);
+                if (offset > data_size || need > data_size - offset) {
+                    // Start again with an empty file. This process, and any
+                    // other with the old one mapped, carries on using it
+                    // without adding anything more.
+                    if (!replaced.exchange(true)) {
+                        (void)create(file, true);
+                    }
+                    return;
+                }
+                std::memcpy(data() + offset, &r, sizeof r);
+                std::memcpy(data() + offset + sizeof r, path.data(), path.size());
+                std::memcpy(data() + offset + sizeof r + path.size(), package.data(), package.size());
+
+                // Prefer the slot of an older copy of the package, then an
+                // unused one, and if there is neither evict the home slot
+                Slot * target = &slots()[h % slot_count];
+                for (uint64_t i = 0; i < max_probes; ++i) {
+                    Slot & slot = slots()[(h + i) % slot_count];
+                    const uint64_t used = slot.load(std::memory_order_acquire);
+                    if (used == 0 || hash_at(used - 1) == h) {
+                        target = &slot;
+                        break;
+                    }
+                }
+
+                // The release makes the record visible to whoever sees the
+                // slot point at it. If two processes publish at once, either
+                // record may win, and both are complete.
+                target->store(offset + 1, std::memory_order_release);
+            }
+
+          private:
+            /// @brief The hash of the record at an offset, or zero if it doesn't fit in the data region
+            uint64_t hash_at(uint64_t offset) const {
+                if (offset > data_size || sizeof(Record) > data_size - offset) {
+                    return 0;
+                }
+                uint64_t h;
+                std::memcpy(&h, data() + offset + offsetof(Record, hash), sizeof h);
+                return h;
+            }
+
+            Header * header() const { return reinterpret_cast<Header *>(base); }
+            Slot * slots() const { return reinterpret_cast<Slot *>(base + slots_offset); }
+            char * data() const { return base + data_offset; }
+
+            const fs::path file;
+            char * base;
+            /// @brief Whether this process has already replaced the file because it was full
+            std::atomic<bool> replaced{false};
+        };
+
+    } // namespace
+
+    std::optional<fs::path> path() {
+        if (const char * env = std::getenv("CPS_CONFIG_SHARED_CACHE"); env != nullptr && env[0] != '\0') {
+            return fs::path{env};
+        }
+        return std::nullopt;
+    }
+
+    cps::search::Loader loader(const fs::path & file, cps::search::Loader fallback) {
+        auto && mapped = Region::map(file);
+        if (!mapped) {
+            return fallback;
+        }
+        return [region = std::move(mapped.value()), fallback = std::move(fallback)](
+                   const fs::path & path) -> tl::expected<cps::loader::Package, std::string> {
+            const Stamp current = inputs::stamp(path);
+            if (!current.exists) {
+                return fallback(path);
+            }
+            if (auto && hit = region->find(path.string(), current)) {
+                if (auto && p = cps::binary::decode(hit.value())) {
+                    ++cps::stats::counters.package_cache_hits;
+                    return std::move(p.value());
+                }
+            }
+            ++cps::stats::counters.package_cache_misses;
+
+            auto && p = fallback(path);
+            if (!p) {
+                return p;
+            }
+            if (auto && encoded = cps::binary::encode(p.value())) {
+                region->publish(path.string(), current, encoded.value());
+            }
+            return p;
+        };
+    }
+
+} // namespace cps_config::shared
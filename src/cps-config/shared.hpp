@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include "cps/search.hpp"
+
+#include <filesystem>
+#include <optional>
+
+namespace cps_config::shared {
+
+    /// @brief The shared package cache, from $CPS_CONFIG_SHARED_CACHE
+    /// @return The file, or nothing if the cache is disabled
+    std::optional<std::filesystem::path> path();
+
+    /// @brief Load packages through a cache shared by every cps-config process
+    ///
+    /// The cache is a file mapped into memory, holding packages which have
+    /// already been parsed in the format of cps::binary. Nobody takes a lock:
+    /// packages are only ever appended, each slot of the table points at the
+    /// latest copy of a package, and a writer points it there with a single
+    /// atomic store once the copy is complete. When the file is full it is
+    /// replaced by renaming a fresh one over it, so processes which still have
+    /// the old one mapped are unaffected.
+    ///
+    /// A cached package is only used if its CPS file is unchanged since it was
+    /// cached. If the file can't be opened or created every package is loaded
+    /// with fallback.
+    ///
+    /// @param file The cache, created if it doesn't exist
+    /// @param fallback Used to load packages which aren't cached
+    cps::search::Loader loader(const std::filesystem::path & file, cps::search::Loader fallback);
+
+} // namespace cps_config::shared
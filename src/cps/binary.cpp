@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "cps/binary.hpp"
+
+#include "cps/error.hpp"
+
+#include <fmt/format.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace cps::binary {
+
+    namespace {
+
+        /// @brief The first bytes of every encoding, the last is bumped whenever the layout changes
+        constexpr std::string_view magic{"CPSB\x02", 5};
+
+        /// @brief The first bytes of a compiled CPS file, which are followed by an encoded package
+        constexpr std::string_view file_magic{"CPSF\x01", 5};
+
+        void put_lang_values(Writer & w, const loader::LangValues & values) {
+            w.u32(static_cast<uint32_t>(values.size()));
+            for (auto && [lang, v] : values) {
+                w.u8(static_cast<uint8_t>(lang));
+                w.strings(v);
+            }
+        }
+
+        void put_defines(Writer & w, const loader::Defines & values) {
+            w.u32(static_cast<uint32_t>(values.size()));
+            for (auto && [lang, v] : values) {
+                w.u8(static_cast<uint8_t>(lang));
+                w.u32(static_cast<uint32_t>(v.size()));
+                for (auto && d : v) {
+                    w.u8(d.is_undefine() ? 0 : d.is_define() ? 1 : 2);
+                    w.string(d.get_name());
+                    w.string(d.get_value());
+                }
+            }
+        }
+
+        tl::expected<loader::LangValues, std::string> get_lang_values(Reader & r) {
+            const uint32_t size = CPS_TRY(r.count());
+            loader::LangValues values;
+            for (uint32_t i = 0; i < size; ++i) {
+                const auto lang = CPS_TRY(r.enumeration(loader::KnownLanguages::fortran));
+                values[lang] = CPS_TRY(r.strings());
+            }
+            return values;
+        }
+
+        tl::expected<loader::Defines, std::string> get_defines(Reader & r) {
+            const uint32_t size = CPS_TRY(r.count());
+            loader::Defines values;
+            for (uint32_t i = 0; i < size; ++i) {
+                const auto lang = CPS_TRY(r.enumeration(loader::KnownLanguages::fortran));
+                const uint32_t n = CPS_TRY(r.count());
+                std::vector<loader::Define> & v = values[lang];
+                v.reserve(n);
+                for (uint32_t j = 0; j < n; ++j) {
+                    const uint8_t kind = CPS_TRY(r.u8());
+                    std::string name = CPS_TRY(r.string());
+                    std::string value = CPS_TRY(r.string());
+                    if (kind == 0) {
+                        v.emplace_back(std::move(name), false);
+                    } else if (kind == 1) {
+                        v.emplace_back(std::move(name));
+                    } else {
+                        v.emplace_back(std::move(name), std::move(value));
+                    }
+                }
+            }
+            return values;
+        }
+
+        tl::expected<loader::Component, std::string> decode_component(Reader & r) {
+            loader::Component c{};
+            c.type = CPS_TRY(r.enumeration(loader::Type::symbolic));
+            c.compile_flags = CPS_TRY(get_lang_values(r));
+            c.includes = CPS_TRY(get_lang_values(r));
+            c.defines = CPS_TRY(get_defines(r));
+            c.link_libraries = CPS_TRY(r.strings());
+            c.location = CPS_TRY(r.optional_string());
+            c.link_location = CPS_TRY(r.optional_string());
+            c.require = CPS_TRY(r.strings());
+            return c;
+        }
+
+    } // namespace
+
+    void Writer::u8(uint8_t v) { buf.push_back(static_cast<char>(v)); }
+
+    void Writer::u32(uint32_t v) {
+        for (int i = 0; i < 4; ++i) {
+            buf.push_back(static_cast<char>((v >> (i * 8)) & 0xff));
+        }
+    }
+
+    void Writer::u64(uint64_t v) {
+        u32(static_cast<uint32_t>(v));
+        u32(static_cast<uint32_t>(v >> 32));
+    }
+
+    void Writer::string(std::string_view s) {
+        u32(static_cast<uint32_t>(s.size()));
+        buf.append(s);
+    }
+
+    void Writer::optional_string(const std::optional<std::string> & s) {
+        u8(s.has_value());
+        if (s) {
+            string(s.value());
+        }
+    }
+
+    void Writer::strings(const std::vector<std::string> & v) {
+        u32(static_cast<uint32_t>(v.size()));
+        for (auto && s : v) {
+            string(s);
+        }
+    }
+
+    Reader::Reader(std::string_view b) : buf{b} {};
+
+    tl::expected<uint8_t, std::string> Reader::u8() {
+        if (buf.empty()) {
+            return truncated();
+        }
+        const auto v = static_cast<uint8_t>(buf[0]);
+        buf.remove_prefix(1);
+        return v;
+    }
+
+    tl::expected<uint32_t, std::string> Reader::u32() {
+        if (buf.size() < 4) {
+            return truncated();
+        }
+        uint32_t v = 0;
+        for (int i = 0; i < 4; ++i) {
+            v |= static_cast<uint32_t>(static_cast<uint8_t>(buf[i])) << (i * 8);
+        }
+        buf.remove_prefix(4);
+        return v;
+    }
+
+    tl::expected<uint64_t, std::string> Reader::u64() {
+        const uint64_t low = CPS_TRY(u32());
+        const uint64_t high = CPS_TRY(u32());
+        return low | (high << 32);
+    }
+
+    tl::expected<std::string, std::string> Reader::string() { return std::string{CPS_TRY(view())}; }
+
+    tl::expected<std::string_view, std::string> Reader::view() {
+        const uint32_t size = CPS_TRY(u32());
+        if (buf.size() < size) {
+            return truncated();
+        }
+        const std::string_view s = buf.substr(0, size);
+        buf.remove_prefix(size);
+        return s;
+    }
+
+    tl::expected<std::optional<std::string>, std::string> Reader::optional_string() {
+        if (CPS_TRY(u8()) == 0) {
+            return std::nullopt;
+        }
+        return CPS_TRY(string());
+    }
+
+    tl::expected<std::vector<std::string>, std::string> Reader::strings() {
+        const uint32_t size = CPS_TRY(count());
+        std::vector<std::string> v;
+        v.reserve(size);
+        for (uint32_t i = 0; i < size; ++i) {
+            v.emplace_back(CPS_TRY(string()));
+        }
+        return v;
+    }
+
+    tl::expected<uint32_t, std::string> Reader::count() {
+        const uint32_t n = CPS_TRY(u32());
+        if (n > buf.size()) {
+            return truncated();
+        }
+        return n;
+    }
+
+    tl::unexpected<std::string> Reader::truncated() const { return tl::unexpected<std::string>("Data is truncated"); }
+
+    tl::expected<std::string, std::string> encode(const loader::Package & p) {
+        Writer w{};
+        w.buf.append(magic);
+        w.string(p.name);
+        w.string(p.cps_version);
+        w.string(p.cps_path);
+        w.optional_string(p.version);
+        w.optional_string(p.compat_version);
+        w.u8(static_cast<uint8_t>(p.version_schema));
+
+        w.u8(p.default_components.has_value());
+        if (p.default_components) {
+            w.strings(p.default_components.value());
+        }
+
+        w.u8(p.platform.has_value());
+        if (p.platform) {
+            w.optional_string(p.platform->c_runtime_vendor);
+            w.optional_string(p.platform->c_runtime_version);
+            w.optional_string(p.platform->cpp_runtime_vendor);
+            w.optional_string(p.platform->cpp_runtime_version);
+        }
+
+        w.u32(static_cast<uint32_t>(p.require.size()));
+        for (auto && [name, req] : p.require) {
+            w.string(name);
+            w.strings(req.components);
+            w.optional_string(req.version);
+        }
+
+        w.u32(static_cast<uint32_t>(p.components.size()));
+        for (auto && [name, c] : p.components) {
+            w.string(name);
+            // A component that hasn't been parsed is kept as JSON, so that
+            // whoever decodes it still only parses the components it uses
+            w.u8(c.raw.has_value());
+            if (c.raw) {
+                w.string(c.raw.value());
+                continue;
+            }
+            w.u8(static_cast<uint8_t>(c.type));
+            put_lang_values(w, c.compile_flags);
+            put_lang_values(w, c.includes);
+            put_defines(w, c.defines);
+            w.strings(c.link_libraries);
+            w.optional_string(c.location);
+            w.optional_string(c.link_location);
+            w.strings(c.require);
+        }
+
+        return std::move(w.buf);
+    }
+
+    tl::expected<loader::Package, std::string> decode(std::string_view data) {
+        if (data.substr(0, magic.size()) != magic) {
+            return tl::unexpected("Not a compiled package, or compiled by another version of cps-config");
+        }
+        Reader r{data.substr(magic.size())};
+
+        loader::Package p{};
+        p.name = CPS_TRY(r.string());
+        p.cps_version = CPS_TRY(r.string());
+        p.cps_path = CPS_TRY(r.string());
+        p.version = CPS_TRY(r.optional_string());
+        p.compat_version = CPS_TRY(r.optional_string());
+        p.version_schema = CPS_TRY(r.enumeration(version::Schema::dpkg));
+
+        if (CPS_TRY(r.u8()) != 0) {
+            p.default_components = CPS_TRY(r.strings());
+        }
+
+        if (CPS_TRY(r.u8()) != 0) {
+            loader::Platform platform{};
+            platform.c_runtime_vendor = CPS_TRY(r.optional_string());
+            platform.c_runtime_version = CPS_TRY(r.optional_string());
+            platform.cpp_runtime_vendor = CPS_TRY(r.optional_string());
+            platform.cpp_runtime_version = CPS_TRY(r.optional_string());
+            p.platform = std::move(platform);
+        }
+
+        const uint32_t requires_count = CPS_TRY(r.count());
+        for (uint32_t i = 0; i < requires_count; ++i) {
+            std::string name = CPS_TRY(r.string());
+            std::vector<std::string> components = CPS_TRY(r.strings());
+            std::optional<std::string> version = CPS_TRY(r.optional_string());
+            p.require.emplace(std::move(name), loader::Requirement{std::move(components), std::move(version)});
+        }
+
+        const uint32_t components_count = CPS_TRY(r.count());
+        p.components.reserve(components_count);
+        // The JSON of unparsed components is copied into one string owned by
+        // the package, and they are pointed into it once it stops growing
+        auto source = std::make_shared<std::string>();
+        std::vector<std::tuple<std::string, size_t, size_t>> unparsed;
+        for (uint32_t i = 0; i < components_count; ++i) {
+            std::string name = CPS_TRY(r.string());
+            if (CPS_TRY(r.u8()) != 0) {
+                const std::string_view raw = CPS_TRY(r.view());
+                unparsed.emplace_back(std::move(name), source->size(), raw.size());
+                source->append(raw);
+            } else {
+                p.components.emplace(std::move(name), CPS_TRY(decode_component(r)));
+            }
+        }
+        for (auto && [name, offset, size] : unparsed) {
+            loader::Component c{};
+            c.raw = std::string_view{*source}.substr(offset, size);
+            p.components.emplace(std::move(name), std::move(c));
+        }
+        if (!unparsed.empty()) {
+            p.source = std::move(source);
+        }
+
+        if (!r.at_end()) {
+            return tl::unexpected("Compiled package has trailing data");
+        }
+
+        loader::parse_versions(p);
+        return p;
+    }
+
+    fs::path compiled_path(const fs::path & cps) {
+        fs::path compiled{cps};
+        compiled += "b";
+        return compiled;
+    }
+
+    tl::expected<std::string, std::string> encode_file(const loader::Package & p, const Source & source,
+                                                       const fs::path & path) {
+        Writer w{};
+        w.buf.append(file_magic);
+        w.u64(static_cast<uint64_t>(source.size));
+        w.u64(static_cast<uint64_t>(source.mtime));
+        // A package without a cps_path gets the directory it was loaded
+        // from, which depends on how the path was spelled
+        w.u8(p.cps_path == path.parent_path().string());
+        w.buf.append(CPS_TRY(encode(p)));
+        return std::move(w.buf);
+    }
+
+    tl::expected<loader::Package, std::string> decode_file(std::string_view data, const Source & source,
+                                                           const fs::path & path) {
+        if (data.substr(0, file_magic.size()) != file_magic) {
+            return tl::unexpected(fmt::format("{} is not a compiled CPS file, or was compiled by another version of "
+                                              "cps-config",
+                                              compiled_path(path).string()));
+        }
+        Reader r{data.substr(file_magic.size())};
+        const Source compiled{static_cast<int64_t>(CPS_TRY(r.u64())), static_cast<int64_t>(CPS_TRY(r.u64()))};
+        if (compiled != source) {
+            return tl::unexpected(fmt::format("{} has changed since it was compiled", path.string()));
+        }
+        const bool cps_path_from_path = CPS_TRY(r.u8()) != 0;
+
+        loader::Package p = CPS_TRY(decode(r.rest()));
+        if (cps_path_from_path) {
+            p.cps_path = path.parent_path().string();
+        }
+        return p;
+    }
+
+} // namespace cps::binary
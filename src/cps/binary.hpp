@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include "cps/loader.hpp"
+
+#include <tl/expected.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cps::binary {
+
+    /// @brief Appends values to a binary encoding
+    ///
+    /// Integers are little endian whatever the host. A string is its length
+    /// followed by its bytes, and a list of strings is its length followed by
+    /// each string.
+    class Writer {
+      public:
+        void u8(uint8_t v);
+        void u32(uint32_t v);
+        void u64(uint64_t v);
+        void string(std::string_view s);
+        void optional_string(const std::optional<std::string> & s);
+        void strings(const std::vector<std::string> & v);
+
+        /// @brief Everything written so far
+        std::string buf;
+    };
+
+    /// @brief Reads back values appended by a Writer
+    ///
+    /// Every read fails rather than reading past the end of the data, so
+    /// damaged data is safe to read.
+    class Reader {
+      public:
+        Reader(std::string_view b);
+
+        tl::expected<uint8_t, std::string> u8();
+        tl::expected<uint32_t, std::string> u32();
+        tl::expected<uint64_t, std::string> u64();
+        tl::expected<std::string, std::string> string();
+        /// @brief A string, which points into the data rather than being copied
+        tl::expected<std::string_view, std::string> view();
+        tl::expected<std::optional<std::string>, std::string> optional_string();
+        tl::expected<std::vector<std::string>, std::string> strings();
+
+        /// @brief A count of items which each take at least one byte, so that
+        ///        a damaged count can't make the reader allocate for more
+        tl::expected<uint32_t, std::string> count();
+
+        /// @brief An enumerator written as a u8
+        /// @param last The last enumerator, anything above it is an error
+        template <typename E> tl::expected<E, std::string> enumeration(E last) {
+            auto && v = u8();
+            if (!v) {
+                return tl::unexpected(v.error());
+            }
+            if (v.value() > static_cast<uint8_t>(last)) {
+                return tl::unexpected("Invalid enumerator " + std::to_string(v.value()));
+            }
+            return static_cast<E>(v.value());
+        }
+
+        bool at_end() const { return buf.empty(); }
+
+        /// @brief Everything not read yet
+        std::string_view rest() const { return buf; }
+
+      private:
+        tl::unexpected<std::string> truncated() const;
+
+        std::string_view buf;
+    };
+
+    /// @brief Encode a package in a compact binary form
+    ///
+    /// The encoding holds no pointers, only lengths, so it can be stored in a
+    /// file or in memory shared between processes and read back from any
+    /// address.
+    ///
+    /// @param p The package. Components that haven't been parsed yet are
+    ///        stored as their JSON, and are parsed when they are first used
+    ///        after decoding.
+    tl::expected<std::string, std::string> encode(const loader::Package & p);
+
+    /// @brief Decode a package written by encode
+    /// @return The package, with its versions parsed, or an error if the data
+    ///         is damaged or from an incompatible version of cps-config
+    tl::expected<loader::Package, std::string> decode(std::string_view data);
+
+    /// @brief Where a CPS file is compiled to: next to it, with a b added to its name
+    std::filesystem::path compiled_path(const std::filesystem::path & cps);
+
+    /// @brief What a compiled CPS file records about the CPS file it was compiled from
+    struct Source {
+        int64_t size = 0;
+        /// @brief The modification time, in nanoseconds
+        int64_t mtime = 0;
+
+        bool operator==(const Source & o) const { return size == o.size && mtime == o.mtime; }
+        bool operator!=(const Source & o) const { return !(*this == o); }
+    };
+
+    /// @brief Encode the contents of a compiled CPS file
+    /// @param p The package loaded from the CPS file
+    /// @param source The CPS file, as it was before it was loaded
+    /// @param path The path the CPS file was loaded from
+    tl::expected<std::string, std::string> encode_file(const loader::Package & p, const Source & source,
+                                                       const std::filesystem::path & path);
+
+    /// @brief Decode the contents of a compiled CPS file
+    ///
+    /// This is a single linear pass which copies every string into the
+    /// returned Package. The package does not point into the data, so the
+    /// data can be freed as soon as this returns.
+    ///
+    /// @param source The CPS file as it is now
+    /// @param path The path of the CPS file, which may be spelled differently than when it was compiled
+    /// @return The package, or an error if the file is damaged or was
+    ///         compiled from a different version of the CPS file
+    tl::expected<loader::Package, std::string> decode_file(std::string_view data, const Source & source,
+                                                           const std::filesystem::path & path);
+
+} // namespace cps::binary
@@ -0,0 +1,309 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "cps/index.hpp"
+
+#include "cps/binary.hpp"
+#include "cps/error.hpp"
+#include "cps/loader.hpp"
+#include "cps/stats.hpp"
+
+#include <fmt/core.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+
+namespace fs = std::filesystem;
+
+namespace cps::index {
+
+    namespace {
+
+        /// @brief The first bytes of an index file, the last is bumped whenever the layout changes
+        constexpr std::string_view magic{"CPSI\x01", 5};
+
+        struct Stamp {
+            int64_t mtime;
+            uint64_t inode;
+            int64_t size;
+        };
+
+        /// @param dir Whether the path must be a directory rather than a regular file
+        std::optional<Stamp> stamp(const fs::path & path, bool dir) {
+            struct stat st;
+            ++stats::counters.files_stated;
+            if (::stat(path.c_str(), &st) != 0 || (dir ? !S_ISDIR(st.st_mode) : !S_ISREG(st.st_mode))) {
+                return std::nullopt;
+            }
+            return Stamp{static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+                         static_cast<uint64_t>(st.st_ino), static_cast<int64_t>(st.st_size)};
+        }
+
+        /// @brief The path of the CPS file for a package in a directory
+        std::string entry_path(const std::string & dir, const std::string & name) {
+            return (fs::path{dir} / (name + ".cps")).string();
+        }
+
+        // An index file is the magic followed by the number of directories,
+        // and then each directory: its path, stamp and number of entries, the
+        // size of its entries, a u32 offset for each entry, and the entries.
+        // The entries are sorted by name so that they can be searched without
+        // decoding them all.
+
+        std::string encode_entry(const std::string & name, const Entry & entry) {
+            binary::Writer w{};
+            w.string(name);
+            w.u64(static_cast<uint64_t>(entry.size));
+            w.u64(static_cast<uint64_t>(entry.mtime));
+            w.u8(entry.loaded);
+            w.optional_string(entry.version);
+            w.optional_string(entry.compat_version);
+            w.strings(entry.components);
+            w.strings(entry.require);
+            return std::move(w.buf);
+        }
+
+        /// @brief Decode the rest of an entry, after its name
+        tl::expected<Entry, std::string> decode_entry(binary::Reader & r, std::string path) {
+            Entry entry{std::move(path)};
+            entry.size = static_cast<int64_t>(CPS_TRY(r.u64()));
+            entry.mtime = static_cast<int64_t>(CPS_TRY(r.u64()));
+            entry.loaded = CPS_TRY(r.u8()) != 0;
+            entry.version = CPS_TRY(r.optional_string());
+            entry.compat_version = CPS_TRY(r.optional_string());
+            entry.components = CPS_TRY(r.strings());
+            entry.require = CPS_TRY(r.strings());
+            return entry;
+        }
+
+    } // namespace
+
+    Entry::Entry() = default;
+    Entry::Entry(std::string path_) : path{std::move(path_)} {};
+
+    Index::Index() = default;
+
+    tl::expected<Index, std::string> Index::decode(std::string data) {
+        if (std::string_view{data}.substr(0, magic.size()) != magic) {
+            return tl::unexpected("unsupported format");
+        }
+        Index index{};
+        index.data = std::move(data);
+        const std::string_view all{index.data};
+
+        binary::Reader r{all.substr(magic.size())};
+        const uint32_t dirs = CPS_TRY(r.count());
+        for (uint32_t i = 0; i < dirs; ++i) {
+            std::string dir = CPS_TRY(r.string());
+            const auto mtime = static_cast<int64_t>(CPS_TRY(r.u64()));
+            const uint64_t inode = CPS_TRY(r.u64());
+            const uint32_t count = CPS_TRY(r.count());
+            const uint32_t entries_size = CPS_TRY(r.u32());
+
+            const size_t offsets = all.size() - r.rest().size();
+            const size_t entries = offsets + static_cast<size_t>(count) * 4;
+            const size_t size = entries - offsets + entries_size;
+            if (r.rest().size() < size) {
+                return tl::unexpected("truncated");
+            }
+            r = binary::Reader{r.rest().substr(size)};
+
+            const std::optional<Stamp> st = stamp(dir, true);
+            if (st && st->mtime == mtime && st->inode == inode) {
+                index.directories.emplace(std::move(dir), Table{offsets, count, entries, entries_size});
+            }
+        }
+        if (!r.at_end()) {
+            return tl::unexpected("trailing data");
+        }
+        return index;
+    }
+
+    bool Index::covers(const fs::path & dir) const { return directories.find(dir.string()) != directories.end(); }
+
+    std::optional<Entry> Index::find(const fs::path & dir, std::string_view name) const {
+        auto && hit = directories.find(dir.string());
+        if (hit == directories.end()) {
+            return std::nullopt;
+        }
+        const Table & t = hit->second;
+        const std::string_view entries = std::string_view{data}.substr(t.entries, t.entries_size);
+
+        // A damaged entry reads as a missing one
+        uint32_t lo = 0;
+        uint32_t hi = t.count;
+        while (lo < hi) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            const size_t at = t.offsets + static_cast<size_t>(mid) * 4;
+            auto && offset = binary::Reader{std::string_view{data}.substr(at, 4)}.u32();
+            if (!offset || offset.value() > entries.size()) {
+                return std::nullopt;
+            }
+            binary::Reader r{entries.substr(offset.value())};
+            auto && entry_name = r.view();
+            if (!entry_name) {
+                return std::nullopt;
+            }
+            if (entry_name.value() < name) {
+                lo = mid + 1;
+            } else if (name < entry_name.value()) {
+                hi = mid;
+            } else {
+                auto && e = decode_entry(r, entry_path(hit->first, std::string{name}));
+                if (!e) {
+                    return std::nullopt;
+                }
+                return std::move(e.value());
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::optional<fs::path> default_path(const utils::Getenv & getenv) {
+        if (const char * env = getenv("CPS_INDEX")) {
+            if (env[0] == '\0') {
+                return std::nullopt;
+            }
+            return fs::path{env};
+        }
+        if (const char * env = getenv("XDG_CACHE_HOME"); env && env[0] != '\0') {
+            return fs::path{env} / "cps-config" / "index";
+        }
+        if (const char * env = getenv("HOME"); env && env[0] != '\0') {
+            return fs::path{env} / ".cache" / "cps-config" / "index";
+        }
+        return std::nullopt;
+    }
+
+    bool current(const Entry & entry) {
+        const std::optional<Stamp> st = stamp(entry.path, false);
+        return st && st->size == entry.size && st->mtime == entry.mtime;
+    }
+
+    tl::expected<Index, std::string> build(const std::vector<fs::path> & dirs) {
+        binary::Writer w{};
+        w.buf.append(magic);
+        std::vector<std::string> seen;
+        std::string body;
+        for (auto && dir : dirs) {
+            // Take the stamp before reading the directory, so that a file added
+            // while we are scanning will make the record stale rather than be
+            // silently missed
+            const std::optional<Stamp> st = stamp(dir, true);
+            if (!st || std::find(seen.begin(), seen.end(), dir.string()) != seen.end()) {
+                continue;
+            }
+            seen.emplace_back(dir.string());
+
+            std::map<std::string, std::string> entries;
+            std::error_code ec;
+            for (auto && file : fs::directory_iterator{dir, ec}) {
+                if (file.path().extension() != ".cps" || !file.is_regular_file(ec)) {
+                    continue;
+                }
+                const std::string name = file.path().stem().string();
+                Entry entry{entry_path(dir.string(), name)};
+                // Likewise the file is stamped before it is loaded
+                const std::optional<Stamp> file_st = stamp(entry.path, false);
+                if (!file_st) {
+                    continue;
+                }
+                entry.size = file_st->size;
+                entry.mtime = file_st->mtime;
+                if (auto && p = loader::load(file.path()); p) {
+                    entry.loaded = true;
+                    entry.version = p->version;
+                    entry.compat_version = p->compat_version;
+                    entry.components.reserve(p->components.size());
+                    for (auto && [c, _] : p->components) {
+                        entry.components.emplace_back(c);
+                    }
+                    entry.require.reserve(p->require.size());
+                    for (auto && [r, _] : p->require) {
+                        entry.require.emplace_back(r);
+                    }
+                }
+                entries.emplace(name, encode_entry(name, entry));
+            }
+
+            binary::Writer d{};
+            d.string(dir.string());
+            d.u64(static_cast<uint64_t>(st->mtime));
+            d.u64(st->inode);
+            d.u32(static_cast<uint32_t>(entries.size()));
+            size_t size = 0;
+            for (auto && [_, e] : entries) {
+                size += e.size();
+            }
+            d.u32(static_cast<uint32_t>(size));
+            size_t offset = 0;
+            for (auto && [_, e] : entries) {
+                d.u32(static_cast<uint32_t>(offset));
+                offset += e.size();
+            }
+            for (auto && [_, e] : entries) {
+                d.buf.append(e);
+            }
+            body.append(d.buf);
+        }
+        w.u32(static_cast<uint32_t>(seen.size()));
+        w.buf.append(body);
+
+        // A directory which changed since it was stamped is dropped here, as
+        // it would be on reading. Anything else which fails to decode means
+        // the encoding above is wrong, and is an error rather than an empty index.
+        return Index::decode(std::move(w.buf)).map_error([](std::string && e) {
+            return fmt::format("Could not build index: {}", e);
+        });
+    }
+
+    tl::expected<Index, std::string> read(const fs::path & path) {
+        std::ifstream file{path, std::ios::binary};
+        if (!file) {
+            return tl::unexpected(fmt::format("Could not open index file {}", path.string()));
+        }
+        std::string data{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+
+        return Index::decode(std::move(data)).map_error([&path](std::string && e) {
+            return fmt::format("Could not read index file {}: {}", path.string(), e);
+        });
+    }
+
+    tl::expected<void, std::string> write(const Index & index, const fs::path & path) {
+        std::error_code ec;
+        if (path.has_parent_path()) {
+            fs::create_directories(path.parent_path(), ec);
+            if (ec) {
+                return tl::unexpected(
+                    fmt::format("Could not create directory {}: {}", path.parent_path().string(), ec.message()));
+            }
+        }
+
+        // Write to a temporary file and rename it into place so that
+        // concurrent readers never see a partially written index
+        const fs::path tmp = fmt::format("{}.{}.tmp", path.string(), ::getpid());
+        {
+            std::ofstream file{tmp, std::ios::binary};
+            file << index.encoded();
+            if (!file) {
+                fs::remove(tmp, ec);
+                return tl::unexpected(fmt::format("Could not write index file {}", tmp.string()));
+            }
+        }
+        fs::rename(tmp, path, ec);
+        if (ec) {
+            const std::string msg = ec.message();
+            fs::remove(tmp, ec);
+            return tl::unexpected(fmt::format("Could not write index file {}: {}", path.string(), msg));
+        }
+
+        return {};
+    }
+
+} // namespace cps::index
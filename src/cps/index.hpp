@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include "cps/utils.hpp"
+
+#include <tl/expected.hpp>
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace cps::index {
+
+    /// @brief What is known about a CPS file without loading it
+    class Entry {
+      public:
+        Entry();
+        Entry(std::string path);
+
+        std::string path;
+        /// @brief The size of the CPS file when the index was built
+        int64_t size = 0;
+        /// @brief The modification time of the CPS file when the index was built, in nanoseconds
+        int64_t mtime = 0;
+        /// @brief Whether the CPS file could be loaded when the index was built.
+        ///        If not, none of the following fields are meaningful.
+        bool loaded = false;
+        std::optional<std::string> version;
+        std::optional<std::string> compat_version;
+        std::vector<std::string> components;
+        std::vector<std::string> require;
+    };
+
+    /// @brief An index of the CPS files in some directories
+    ///
+    /// This is kept in the form it is stored in: the entries of each
+    /// directory sorted by name, behind a table of where each starts. Reading
+    /// an index is only reading the file, and a lookup decodes just the
+    /// entries it has to look at, so even a large index is cheap to use.
+    class Index {
+      public:
+        Index();
+
+        /// @brief Make an index from its encoded form
+        ///
+        /// Any directory whose modification time or inode no longer match the
+        /// recorded values is left out, so that callers fall back to looking
+        /// at the filesystem directly.
+        static tl::expected<Index, std::string> decode(std::string data);
+
+        /// @brief The form the index is stored in
+        const std::string & encoded() const { return data; }
+
+        /// @brief Whether the index knows every CPS file in a directory
+        bool covers(const std::filesystem::path & dir) const;
+
+        /// @brief Look up a package in a directory
+        /// @return The entry, or nothing if the directory isn't covered or has no CPS file for the package
+        std::optional<Entry> find(const std::filesystem::path & dir, std::string_view name) const;
+
+      private:
+        /// @brief Where a directory's entries are in the data
+        struct Table {
+            /// @brief Where the offset of each entry, relative to entries, is
+            size_t offsets;
+            uint32_t count;
+            size_t entries;
+            size_t entries_size;
+        };
+
+        std::string data;
+        /// @brief Each covered directory
+        std::unordered_map<std::string, Table> directories;
+    };
+
+    /// @brief The index file to use when one isn't explicitly provided
+    ///
+    /// This is $CPS_INDEX if set, otherwise cps-config/index in the XDG cache
+    /// directory, or nothing if there is no cache directory either.
+    ///
+    /// @param getenv Where the variables are read from
+    std::optional<std::filesystem::path> default_path(const utils::Getenv & getenv = std::getenv);
+
+    /// @brief Whether an entry still describes its CPS file
+    ///
+    /// The directory's stamp covers which files it holds, but not what they
+    /// say, since a file can be edited in place without touching its
+    /// directory. This checks the file itself.
+    bool current(const Entry & entry);
+
+    /// @brief Scan each directory and record every CPS file in it
+    /// @param dirs The cps directories to scan, directories which do not exist are skipped
+    /// @return The index, or an error if it could not be encoded
+    tl::expected<Index, std::string> build(const std::vector<std::filesystem::path> & dirs);
+
+    /// @brief Read an index file
+    ///
+    /// Stale directories are left out, see Index::decode. The files in a
+    /// directory which is kept are not checked, see current().
+    tl::expected<Index, std::string> read(const std::filesystem::path & path);
+
+    /// @brief Atomically write an index file
+    tl::expected<void, std::string> write(const Index & index, const std::filesystem::path & path);
+
+} // namespace cps::index
@@ -0,0 +1,322 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "cps/json.hpp"
+
+#include "cps/error.hpp"
+
+#include <fmt/core.h>
+
+#include <cstdint>
+
+namespace cps::json {
+
+    namespace {
+
+        bool is_number_char(char c) {
+            return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+        }
+
+        int hex_value(char c) {
+            if (c >= '0' && c <= '9') {
+                return c - '0';
+            }
+            if (c >= 'a' && c <= 'f') {
+                return c - 'a' + 10;
+            }
+            if (c >= 'A' && c <= 'F') {
+                return c - 'A' + 10;
+            }
+            return -1;
+        }
+
+        void append_utf8(std::string & out, uint32_t cp) {
+            if (cp < 0x80) {
+                out.push_back(static_cast<char>(cp));
+            } else if (cp < 0x800) {
+                out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+                out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+            } else if (cp < 0x10000) {
+                out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+                out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+                out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+            } else {
+                out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+                out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+                out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+                out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+            }
+        }
+
+    } // namespace
+
+    Reader::Reader(std::string_view buffer_) : buf{buffer_} {};
+
+    std::string Reader::error(std::string_view msg) const {
+        size_t line = 1;
+        size_t col = 1;
+        for (size_t i = 0; i < pos && i < buf.size(); ++i) {
+            if (buf[i] == '\n') {
+                ++line;
+                col = 1;
+            } else {
+                ++col;
+            }
+        }
+        return fmt::format("JSON error at line {}, column {}: {}", line, col, msg);
+    }
+
+    void Reader::skip_whitespace() {
+        while (pos < buf.size()) {
+            const char c = buf[pos];
+            if (c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+                return;
+            }
+            ++pos;
+        }
+    }
+
+    bool Reader::at_end() {
+        skip_whitespace();
+        return pos == buf.size();
+    }
+
+    size_t Reader::offset() const { return pos; }
+
+    std::string_view Reader::buffer() const { return buf; }
+
+    tl::expected<Type, std::string> Reader::peek() {
+        skip_whitespace();
+        if (pos == buf.size()) {
+            return tl::unexpected(error("unexpected end of input"));
+        }
+        switch (buf[pos]) {
+        case '{':
+            return Type::object;
+        case '[':
+            return Type::array;
+        case '"':
+            return Type::string;
+        case 't':
+        case 'f':
+            return Type::boolean;
+        case 'n':
+            return Type::null;
+        default:
+            if (is_number_char(buf[pos])) {
+                return Type::number;
+            }
+            return tl::unexpected(error(fmt::format("unexpected character '{}'", buf[pos])));
+        }
+    }
+
+    tl::expected<Type, std::string> Reader::enter() {
+        const Type t = CPS_TRY(peek());
+        if (t != Type::object && t != Type::array) {
+            return tl::unexpected(error("expected an object or an array"));
+        }
+        ++pos;
+        started.push_back(false);
+        return t;
+    }
+
+    tl::expected<bool, std::string> Reader::next(char close) {
+        if (started.empty()) {
+            return tl::unexpected(error("not inside of an object or array"));
+        }
+        skip_whitespace();
+        if (pos == buf.size()) {
+            return tl::unexpected(error("unexpected end of input"));
+        }
+        if (buf[pos] == close) {
+            ++pos;
+            started.pop_back();
+            return false;
+        }
+        if (started.back()) {
+            if (buf[pos] != ',') {
+                return tl::unexpected(error(fmt::format("expected ',' or '{}'", close)));
+            }
+            ++pos;
+            skip_whitespace();
+        }
+        started.back() = true;
+        return true;
+    }
+
+    tl::expected<bool, std::string> Reader::next_member(std::string_view & key) {
+        if (!CPS_TRY(next('}'))) {
+            return false;
+        }
+        if (pos == buf.size() || buf[pos] != '"') {
+            return tl::unexpected(error("expected a string key"));
+        }
+        key = CPS_TRY(read_string(key_scratch));
+        skip_whitespace();
+        if (pos == buf.size() || buf[pos] != ':') {
+            return tl::unexpected(error("expected ':'"));
+        }
+        ++pos;
+        return true;
+    }
+
+    tl::expected<bool, std::string> Reader::next_element() { return next(']'); }
+
+    tl::expected<std::string_view, std::string> Reader::string() {
+        if (CPS_TRY(peek()) != Type::string) {
+            return tl::unexpected(error("expected a string"));
+        }
+        return read_string(string_scratch);
+    }
+
+    tl::expected<std::string_view, std::string> Reader::read_string(std::string & scratch) {
+        // Skip the opening quote
+        const size_t start = ++pos;
+
+        // The common case is a string with no escapes, which can be returned
+        // as a view of the buffer
+        while (pos < buf.size() && buf[pos] != '"' && buf[pos] != '\\') {
+            ++pos;
+        }
+        if (pos == buf.size()) {
+            return tl::unexpected(error("unterminated string"));
+        }
+        if (buf[pos] == '"') {
+            return buf.substr(start, pos++ - start);
+        }
+
+        scratch.assign(buf.substr(start, pos - start));
+        while (pos < buf.size()) {
+            const char c = buf[pos++];
+            if (c == '"') {
+                return std::string_view{scratch};
+            }
+            if (c != '\\') {
+                scratch.push_back(c);
+                continue;
+            }
+            if (pos == buf.size()) {
+                break;
+            }
+            switch (buf[pos++]) {
+            case '"':
+                scratch.push_back('"');
+                break;
+            case '\\':
+                scratch.push_back('\\');
+                break;
+            case '/':
+                scratch.push_back('/');
+                break;
+            case 'b':
+                scratch.push_back('\b');
+                break;
+            case 'f':
+                scratch.push_back('\f');
+                break;
+            case 'n':
+                scratch.push_back('\n');
+                break;
+            case 'r':
+                scratch.push_back('\r');
+                break;
+            case 't':
+                scratch.push_back('\t');
+                break;
+            case 'u': {
+                const auto && read_hex = [this]() -> int32_t {
+                    if (buf.size() - pos < 4) {
+                        return -1;
+                    }
+                    int32_t v = 0;
+                    for (size_t i = 0; i < 4; ++i) {
+                        const int h = hex_value(buf[pos++]);
+                        if (h < 0) {
+                            return -1;
+                        }
+                        v = (v << 4) | h;
+                    }
+                    return v;
+                };
+                int32_t cp = read_hex();
+                if (cp < 0) {
+                    return tl::unexpected(error("invalid unicode escape"));
+                }
+                // A high surrogate must be followed by a low surrogate
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    if (buf.substr(pos, 2) != "\\u") {
+                        return tl::unexpected(error("unpaired surrogate in unicode escape"));
+                    }
+                    pos += 2;
+                    const int32_t low = read_hex();
+                    if (low < 0xDC00 || low > 0xDFFF) {
+                        return tl::unexpected(error("unpaired surrogate in unicode escape"));
+                    }
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                append_utf8(scratch, static_cast<uint32_t>(cp));
+                break;
+            }
+            default:
+                return tl::unexpected(error("invalid escape sequence"));
+            }
+        }
+
+        return tl::unexpected(error("unterminated string"));
+    }
+
+    tl::expected<Type, std::string> Reader::skip_scalar(Type t) {
+        switch (t) {
+        case Type::string:
+            CPS_TRY(read_string(string_scratch));
+            break;
+        case Type::number:
+            while (pos < buf.size() && is_number_char(buf[pos])) {
+                ++pos;
+            }
+            break;
+        case Type::boolean:
+        case Type::null: {
+            const std::string_view word = t == Type::null ? "null" : buf[pos] == 't' ? "true" : "false";
+            if (buf.substr(pos, word.size()) != word) {
+                return tl::unexpected(error("invalid literal"));
+            }
+            pos += word.size();
+            break;
+        }
+        case Type::object:
+        case Type::array:
+            return tl::unexpected(error("expected a scalar"));
+        }
+        return t;
+    }
+
+    tl::expected<Type, std::string> Reader::skip() {
+        const Type t = CPS_TRY(peek());
+        if (t != Type::object && t != Type::array) {
+            return skip_scalar(t);
+        }
+
+        // Containers are walked with a stack rather than by recursing, so
+        // that deeply nested input can't overflow the call stack. Each entry
+        // is whether that container is an object.
+        std::vector<bool> objects{t == Type::object};
+        CPS_TRY(enter());
+        std::string_view key;
+        while (!objects.empty()) {
+            if (!CPS_TRY(objects.back() ? next_member(key) : next_element())) {
+                objects.pop_back();
+                continue;
+            }
+            const Type v = CPS_TRY(peek());
+            if (v == Type::object || v == Type::array) {
+                CPS_TRY(enter());
+                objects.push_back(v == Type::object);
+            } else {
+                CPS_TRY(skip_scalar(v));
+            }
+        }
+        return t;
+    }
+
+} // namespace cps::json
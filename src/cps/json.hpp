@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include <tl/expected.hpp>
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cps::json {
+
+    /// @brief The type of a JSON value
+    enum class Type {
+        null,
+        boolean,
+        number,
+        string,
+        array,
+        object,
+    };
+
+    /// @brief A pull parser over a JSON document held in memory
+    ///
+    /// Values are read in document order without building a tree. Containers
+    /// are entered with enter(), and then walked with next_member() or
+    /// next_element() until they return false. Anything the caller isn't
+    /// interested in can be passed over with skip().
+    class Reader {
+      public:
+        Reader(std::string_view buffer);
+
+        /// @brief Get the type of the next value without consuming it
+        tl::expected<Type, std::string> peek();
+
+        /// @brief Consume the opening bracket of an object or array
+        /// @return The type of the container entered
+        tl::expected<Type, std::string> enter();
+
+        /// @brief Advance to the next member of the current object
+        /// @param key Set to the name of the member. This points into the
+        ///        buffer, or into storage owned by the Reader which is only valid
+        ///        until the next call to next_member.
+        /// @return false once the closing brace has been consumed
+        tl::expected<bool, std::string> next_member(std::string_view & key);
+
+        /// @brief Advance to the next element of the current array
+        /// @return false once the closing bracket has been consumed
+        tl::expected<bool, std::string> next_element();
+
+        /// @brief Read a string value
+        /// @return The unescaped string. This points into the buffer, or into
+        ///         storage owned by the Reader which is only valid until the next
+        ///         call to string.
+        tl::expected<std::string_view, std::string> string();
+
+        /// @brief Consume the next value, whatever it is
+        /// @return The type of the value skipped
+        tl::expected<Type, std::string> skip();
+
+        /// @brief Whether only whitespace remains
+        bool at_end();
+
+        /// @brief The current position in the buffer
+        size_t offset() const;
+
+        /// @brief The buffer being read
+        std::string_view buffer() const;
+
+      private:
+        void skip_whitespace();
+        tl::expected<std::string_view, std::string> read_string(std::string & scratch);
+        tl::expected<bool, std::string> next(char close);
+        /// @brief Consume a value which isn't a container
+        tl::expected<Type, std::string> skip_scalar(Type t);
+        std::string error(std::string_view msg) const;
+
+        std::string_view buf;
+        size_t pos = 0;
+        /// @brief For each open container, whether a value has been read from it yet
+        std::vector<bool> started;
+        std::string key_scratch;
+        std::string string_scratch;
+    };
+
+} // namespace cps::json
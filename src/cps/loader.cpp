@@ -4,16 +4,27 @@
 
 #include "cps/loader.hpp"
 
+#include "cps/binary.hpp"
+#include "cps/config.hpp"
 #include "cps/error.hpp"
+#include "cps/json.hpp"
+#include "cps/stats.hpp"
+#include "cps/trace.hpp"
 #include "cps/utils.hpp"
 
 #include <fmt/core.h>
 #include <json/json.h>
 #include <tl/expected.hpp>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
 #include <filesystem>
-#include <fstream>
-#include <iostream>
+#include <memory>
+#include <optional>
 
 namespace fs = std::filesystem;
 
@@ -21,6 +32,12 @@ namespace cps::loader {
 
     namespace {
 
+#if CPS_USE_STREAMING_LOADER
+        constexpr Backend default_backend = Backend::streaming;
+#else
+        constexpr Backend default_backend = Backend::jsoncpp;
+#endif
+
         template <typename T>
         tl::expected<std::optional<T>, std::string>
         get_optional(const Json::Value & parent, std::string_view parent_name, const std::string & name) {
@@ -133,14 +150,12 @@ namespace cps::loader {
             return ret;
         }
 
-        tl::expected<Defines, std::string> get_defines(const Json::Value & parent, std::string_view parent_name,
-                                                       const std::string & name) {
-            LangValues && lang = CPS_TRY(get_lang_values(parent, parent_name, name));
+        Defines make_defines(LangValues && lang) {
             Defines ret;
             for (auto && [k, values] : lang) {
                 ret[k] = {};
                 for (auto && value : values) {
-                    if (value.front() == '!') {
+                    if (!value.empty() && value.front() == '!') {
                         ret[k].emplace_back(Define{value.substr(1), false});
                     } else if (const size_t sep = value.find("="); sep != value.npos) {
                         std::string dkey = value.substr(0, sep);
@@ -152,6 +167,11 @@ namespace cps::loader {
                 }
             }
             return ret;
+        }
+
+        tl::expected<Defines, std::string> get_defines(const Json::Value & parent, std::string_view parent_name,
+                                                       const std::string & name) {
+            return make_defines(CPS_TRY(get_lang_values(parent, parent_name, name)));
         };
 
         tl::expected<Requires, std::string> get_requires(const Json::Value & parent, std::string_view parent_name,
@@ -172,9 +192,9 @@ namespace cps::loader {
                 const Json::Value obj = *itr;
 
                 ret.emplace(key, Requirement{
-                                     CPS_TRY(get_optional<std::vector<std::string>>(require, name, "components"))
+                                     CPS_TRY(get_optional<std::vector<std::string>>(obj, key, "components"))
                                          .value_or(std::vector<std::string>{}),
-                                     CPS_TRY(get_optional<std::string>(require, name, "version")),
+                                     CPS_TRY(get_optional<std::string>(obj, key, "version")),
                                  });
             }
 
@@ -227,8 +247,406 @@ namespace cps::loader {
             return components;
         };
 
+        /// @brief Closes a file descriptor when it goes out of scope
+        struct File {
+            ~File() {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+            const int fd;
+        };
+
+        /// @brief Read the rest of an open file
+        tl::expected<std::string, std::string> read_fd(int fd, const fs::path & path) {
+            struct stat st;
+            ++stats::counters.files_stated;
+            if (::fstat(fd, &st) != 0) {
+                return tl::unexpected(fmt::format("Could not stat {}: {}", path.string(), std::strerror(errno)));
+            }
+
+            // Ask for one byte more than the size, so that a file which grew
+            // since fstat is noticed rather than truncated
+            size_t size = 0;
+            std::string buffer;
+            buffer.resize(static_cast<size_t>(st.st_size) + 1);
+            while (true) {
+                const ssize_t r = ::read(fd, buffer.data() + size, buffer.size() - size);
+                if (r < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return tl::unexpected(fmt::format("Could not read {}: {}", path.string(), std::strerror(errno)));
+                }
+                if (r == 0) {
+                    break;
+                }
+                size += static_cast<size_t>(r);
+                if (size == buffer.size()) {
+                    buffer.resize(buffer.size() * 2);
+                }
+            }
+
+            buffer.resize(size);
+            return buffer;
+        }
+
+        /// @brief Read an entire file
+        ///
+        /// The file is read with a single read() call in the common case,
+        /// rather than going through iostreams.
+        tl::expected<std::string, std::string> read_file(const fs::path & path) {
+            const File file{::open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+            if (file.fd < 0) {
+                return tl::unexpected(fmt::format("Could not open {}: {}", path.string(), std::strerror(errno)));
+            }
+            return read_fd(file.fd, path);
+        }
+
+        binary::Source source_of(const struct stat & st) {
+            return binary::Source{static_cast<int64_t>(st.st_size),
+                                  static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec};
+        }
+
+        /// @brief Load the compiled form of a CPS file
+        /// @return The package, or nothing if the CPS file hasn't been
+        ///         compiled, or has changed since, or the compiled file can't
+        ///         be read, in which case the CPS file should be parsed
+        std::optional<Package> load_compiled(const fs::path & path) {
+            // Most CPS files aren't compiled, so finding that out costs one
+            // failed open() and nothing else
+            const fs::path compiled = binary::compiled_path(path);
+            const File file{::open(compiled.c_str(), O_RDONLY | O_CLOEXEC)};
+            if (file.fd < 0) {
+                return std::nullopt;
+            }
+
+            trace::Span span{"load_compiled"};
+            span.arg("path", path.native());
+            struct stat st;
+            ++stats::counters.files_stated;
+            if (::stat(path.c_str(), &st) != 0) {
+                return std::nullopt;
+            }
+            auto && contents = read_fd(file.fd, compiled);
+            if (!contents) {
+                return std::nullopt;
+            }
+            span.arg("bytes", contents->size());
+
+            auto && p = binary::decode_file(contents.value(), source_of(st), path);
+            if (!p) {
+                return std::nullopt;
+            }
+            ++stats::counters.files_compiled;
+            stats::counters.bytes_read += contents->size();
+            return std::move(p.value());
+        }
+
+        tl::expected<Package, std::string> load_jsoncpp(const fs::path & path, std::string_view buffer) {
+            Json::Value root;
+            std::string errors;
+            const std::unique_ptr<Json::CharReader> json_reader{Json::CharReaderBuilder{}.newCharReader()};
+            if (!json_reader->parse(buffer.data(), buffer.data() + buffer.size(), &root, &errors)) {
+                return tl::unexpected(fmt::format("Could not parse {}: {}", path.string(), errors));
+            }
+
+            return Package{
+                CPS_TRY(get_required<std::string>(root, "package", "name")),
+                CPS_TRY(get_required<std::string>(root, "package", "cps_version")),
+                CPS_TRY(get_components(root, "package", "components")),
+                CPS_TRY(get_optional<std::string>(root, "package", "cps_path")).value_or(path.parent_path()),
+                CPS_TRY(get_optional<std::vector<std::string>>(root, "package", "default_components")),
+                CPS_TRY(get_requires(root, "package", "requires")),
+                CPS_TRY(get_optional<std::string>(root, "package", "version")),
+                CPS_TRY(get_optional<std::string>(root, "package", "compat_version")),
+                CPS_TRY(get_optional<std::string>(root, "package", "version_schema").map([](auto && v) {
+                    return string_to_schema(v.value_or("simple"));
+                })),
+            };
+        }
+
+        // The streaming backend. This fills in the Package as it walks the
+        // document, rather than building a Json::Value tree and then copying
+        // out of it. The error messages match the jsoncpp backend.
+
+        template <typename T>
+        tl::expected<T, std::string> read_value(json::Reader & reader, std::string_view parent_name,
+                                                std::string_view name) {
+            const auto && wrong_type = [&]() {
+                return tl::unexpected(
+                    fmt::format("Optional field {} in {} is not of type {}!", name, parent_name, typeid(T).name()));
+            };
+
+            if constexpr (std::is_same_v<T, std::string>) {
+                if (CPS_TRY(reader.peek()) != json::Type::string) {
+                    return wrong_type();
+                }
+                return std::string{CPS_TRY(reader.string())};
+            } else if constexpr (std::is_same_v<T, std::vector<std::string>>) {
+                if (CPS_TRY(reader.peek()) != json::Type::array) {
+                    return wrong_type();
+                }
+                CPS_TRY(reader.enter());
+                std::vector<std::string> ret;
+                while (CPS_TRY(reader.next_element())) {
+                    if (CPS_TRY(reader.peek()) != json::Type::string) {
+                        return wrong_type();
+                    }
+                    ret.emplace_back(CPS_TRY(reader.string()));
+                }
+                return ret;
+            }
+        }
+
+        std::optional<KnownLanguages> string_to_language(std::string_view str) {
+            if (str == "c") {
+                return KnownLanguages::c;
+            }
+            if (str == "c++") {
+                return KnownLanguages::cxx;
+            }
+            if (str == "fortran") {
+                return KnownLanguages::fortran;
+            }
+            return std::nullopt;
+        }
+
+        tl::expected<LangValues, std::string> read_lang_values(json::Reader & reader, std::string_view parent_name,
+                                                               std::string_view name) {
+            LangValues ret{};
+            switch (CPS_TRY(reader.peek())) {
+            case json::Type::object: {
+                for (auto && l : {KnownLanguages::c, KnownLanguages::cxx, KnownLanguages::fortran}) {
+                    ret[l] = {};
+                }
+                CPS_TRY(reader.enter());
+                std::string_view key;
+                while (CPS_TRY(reader.next_member(key))) {
+                    if (auto && lang = string_to_language(key); lang) {
+                        ret[lang.value()] = CPS_TRY(read_value<std::vector<std::string>>(reader, name, key));
+                    } else {
+                        CPS_TRY(reader.skip());
+                    }
+                }
+                break;
+            }
+            case json::Type::array: {
+                std::vector<std::string> fin = CPS_TRY(read_value<std::vector<std::string>>(reader, parent_name, name));
+                for (auto && v : {KnownLanguages::c, KnownLanguages::cxx, KnownLanguages::fortran}) {
+                    ret.emplace(v, fin);
+                }
+                break;
+            }
+            default:
+                return tl::unexpected(
+                    fmt::format("Section {} of {} is neither an object nor an array!", parent_name, name));
+            }
+            return ret;
+        }
+
+        tl::expected<Requires, std::string> read_requires(json::Reader & reader, std::string_view parent_name,
+                                                          std::string_view name) {
+            if (CPS_TRY(reader.peek()) != json::Type::object) {
+                return tl::unexpected(fmt::format("{} field of {} is not an object", name, parent_name));
+            }
+
+            Requires ret{};
+            CPS_TRY(reader.enter());
+            std::string_view key_view;
+            while (CPS_TRY(reader.next_member(key_view))) {
+                const std::string key{key_view};
+                if (CPS_TRY(reader.peek()) != json::Type::object) {
+                    return tl::unexpected(fmt::format("{} {} is not an object", name, key));
+                }
+
+                Requirement req{};
+                CPS_TRY(reader.enter());
+                std::string_view field;
+                while (CPS_TRY(reader.next_member(field))) {
+                    if (field == "components") {
+                        req.components = CPS_TRY(read_value<std::vector<std::string>>(reader, key, field));
+                    } else if (field == "version") {
+                        req.version = CPS_TRY(read_value<std::string>(reader, key, field));
+                    } else {
+                        CPS_TRY(reader.skip());
+                    }
+                }
+                ret.insert_or_assign(key, std::move(req));
+            }
+
+            return ret;
+        }
+
+        tl::expected<Component, std::string> read_component(json::Reader & reader, std::string_view name,
+                                                            std::string_view key) {
+            if (CPS_TRY(reader.peek()) != json::Type::object) {
+                return tl::unexpected(fmt::format("{} {} is not an object", name, key));
+            }
+
+            Component comp{};
+            bool has_type = false;
+            CPS_TRY(reader.enter());
+            std::string_view field;
+            while (CPS_TRY(reader.next_member(field))) {
+                if (field == "type") {
+                    comp.type = string_to_type(CPS_TRY(read_value<std::string>(reader, name, "type")));
+                    has_type = true;
+                } else if (field == "compile_flags") {
+                    comp.compile_flags = CPS_TRY(read_lang_values(reader, name, "compile_flags"));
+                } else if (field == "includes") {
+                    comp.includes = CPS_TRY(read_lang_values(reader, name, "includes"));
+                } else if (field == "defines") {
+                    comp.defines = make_defines(CPS_TRY(read_lang_values(reader, name, "defines")));
+                } else if (field == "link_libraries") {
+                    comp.link_libraries = CPS_TRY(read_value<std::vector<std::string>>(reader, name, "link_libraries"));
+                } else if (field == "location") {
+                    comp.location = CPS_TRY(read_value<std::string>(reader, name, "location"));
+                } else if (field == "link_location") {
+                    // XXX: https://github.com/cps-org/cps/issues/34
+                    comp.link_location = CPS_TRY(read_value<std::string>(reader, name, "link_location"));
+                } else if (field == "requires") {
+                    comp.require = CPS_TRY(read_value<std::vector<std::string>>(reader, name, "requires"));
+                } else {
+                    CPS_TRY(reader.skip());
+                }
+            }
+
+            if (!has_type) {
+                return tl::unexpected(fmt::format("Required field type in {} is missing!", name));
+            }
+            return comp;
+        }
+
+        tl::expected<std::unordered_map<std::string, Component>, std::string>
+        read_components(json::Reader & reader, std::string_view parent_name, std::string_view name) {
+            if (CPS_TRY(reader.peek()) != json::Type::object) {
+                return tl::unexpected(fmt::format("{} field of {} is not an object", name, parent_name));
+            }
+
+            // Components are not parsed here, only located. Large packages may
+            // have hundreds of components of which a query needs only a few, so
+            // each one is parsed by Package::get_component when it is first used.
+            std::unordered_map<std::string, Component> components{};
+            CPS_TRY(reader.enter());
+            std::string_view key_view;
+            while (CPS_TRY(reader.next_member(key_view))) {
+                std::string key{key_view};
+                if (CPS_TRY(reader.peek()) != json::Type::object) {
+                    return tl::unexpected(fmt::format("{} {} is not an object", name, key));
+                }
+                const size_t start = reader.offset();
+                CPS_TRY(reader.skip());
+                Component comp{};
+                comp.raw = reader.buffer().substr(start, reader.offset() - start);
+                components.insert_or_assign(std::move(key), std::move(comp));
+            }
+
+            if (components.empty()) {
+                return tl::unexpected(fmt::format("Components field of {} is empty, but must "
+                                                  "have at least one component",
+                                                  parent_name));
+            }
+            return components;
+        }
+
+        tl::expected<Package, std::string> load_streaming(const fs::path & path,
+                                                          std::shared_ptr<const std::string> source) {
+            json::Reader reader{*source};
+            if (CPS_TRY(reader.peek()) != json::Type::object) {
+                return tl::unexpected(fmt::format("{} is not a JSON object", path.string()));
+            }
+
+            std::optional<std::string> name;
+            std::optional<std::string> cps_version;
+            std::optional<std::unordered_map<std::string, Component>> components;
+            std::optional<std::string> cps_path;
+            std::optional<std::vector<std::string>> default_components;
+            Requires require{};
+            std::optional<std::string> version;
+            std::optional<std::string> compat_version;
+            version::Schema schema = version::Schema::simple;
+
+            CPS_TRY(reader.enter());
+            std::string_view field;
+            while (CPS_TRY(reader.next_member(field))) {
+                if (field == "name") {
+                    name = CPS_TRY(read_value<std::string>(reader, "package", "name"));
+                } else if (field == "cps_version") {
+                    cps_version = CPS_TRY(read_value<std::string>(reader, "package", "cps_version"));
+                } else if (field == "components") {
+                    components = CPS_TRY(read_components(reader, "package", "components"));
+                } else if (field == "cps_path") {
+                    cps_path = CPS_TRY(read_value<std::string>(reader, "package", "cps_path"));
+                } else if (field == "default_components") {
+                    default_components =
+                        CPS_TRY(read_value<std::vector<std::string>>(reader, "package", "default_components"));
+                } else if (field == "requires") {
+                    require = CPS_TRY(read_requires(reader, "package", "requires"));
+                } else if (field == "version") {
+                    version = CPS_TRY(read_value<std::string>(reader, "package", "version"));
+                } else if (field == "compat_version") {
+                    compat_version = CPS_TRY(read_value<std::string>(reader, "package", "compat_version"));
+                } else if (field == "version_schema") {
+                    schema = string_to_schema(CPS_TRY(read_value<std::string>(reader, "package", "version_schema")));
+                } else {
+                    CPS_TRY(reader.skip());
+                }
+            }
+            if (!reader.at_end()) {
+                return tl::unexpected(fmt::format("{} has trailing data after the package", path.string()));
+            }
+
+            if (!name) {
+                return tl::unexpected("Required field name in package is missing!");
+            }
+            if (!cps_version) {
+                return tl::unexpected("Required field cps_version in package is missing!");
+            }
+            if (!components) {
+                return tl::unexpected("Required field Components of package is missing!");
+            }
+
+            Package package{
+                std::move(name.value()),
+                std::move(cps_version.value()),
+                std::move(components.value()),
+                cps_path.value_or(path.parent_path()),
+                std::move(default_components),
+                std::move(require),
+                std::move(version),
+                std::move(compat_version),
+                schema,
+            };
+            package.source = std::move(source);
+            return package;
+        }
+
+        std::optional<version::Version> parse_simple(const std::optional<std::string> & v) {
+            if (!v) {
+                return std::nullopt;
+            }
+            auto && parsed = version::Version::parse(v.value());
+            if (!parsed) {
+                return std::nullopt;
+            }
+            return parsed.value();
+        }
+
     } // namespace
 
+    void parse_versions(Package & p) {
+        if (p.version_schema == version::Schema::simple) {
+            p.parsed_version = parse_simple(p.version);
+        }
+        // The schema of a requirement is that of the package which
+        // satisfies it, which isn't known yet. Only the simple schema can
+        // be parsed ahead of time, so assume that.
+        for (auto && [_, req] : p.require) {
+            req.parsed_version = parse_simple(req.version);
+        }
+    }
+
     Define::Define(std::string name_) : name{std::move(name_)}, value{}, define{true} {};
     Define::Define(std::string name_, std::string value_)
         : name{std::move(name_)}, value{std::move(value_)}, define{true} {};
@@ -259,33 +677,103 @@ namespace cps::loader {
 
     Platform::Platform() = default;
 
+    tl::expected<const Component *, std::string> Package::get_component(const std::string & comp_name) {
+        auto && found = components.find(comp_name);
+        if (found == components.end()) {
+            return tl::unexpected(fmt::format("Package {} has no component {}", name, comp_name));
+        }
+        if (auto && raw = found->second.raw; raw) {
+            json::Reader reader{raw.value()};
+            found->second = CPS_TRY(read_component(reader, "components", comp_name));
+        }
+        return &found->second;
+    }
+
     Package::Package() = default;
     Package::Package(std::string _name, std::string _cps_version,
                      std::unordered_map<std::string, Component> && _components, std::string cps_path_,
                      std::optional<std::vector<std::string>> && _default_comps, Requires req,
-                     std::optional<std::string> ver, version::Schema schema)
+                     std::optional<std::string> ver, std::optional<std::string> compat_ver,
+                     version::Schema schema)
         : name{std::move(_name)}, cps_version{std::move(_cps_version)}, components{std::move(_components)},
-          cps_path{std::move(cps_path_)}, default_components{std::move(_default_comps)}, require{std::move(req)},
-          version{std::move(ver)}, version_schema{schema} {};
+          compat_version{std::move(compat_ver)}, cps_path{std::move(cps_path_)},
+          default_components{std::move(_default_comps)}, require{std::move(req)}, version{std::move(ver)},
+          version_schema{schema} {};
 
     tl::expected<Package, std::string> load(const fs::path & path) {
-        std::ifstream file;
-        file.open(path);
-
-        Json::Value root;
-        file >> root;
-
-        return Package{
-            CPS_TRY(get_required<std::string>(root, "package", "name")),
-            CPS_TRY(get_required<std::string>(root, "package", "cps_version")),
-            CPS_TRY(get_components(root, "package", "components")),
-            CPS_TRY(get_optional<std::string>(root, "package", "cps_path")).value_or(path.parent_path()),
-            CPS_TRY(get_optional<std::vector<std::string>>(root, "package", "default_components")),
-            CPS_TRY(get_requires(root, "package", "requires")),
-            CPS_TRY(get_optional<std::string>(root, "package", "version")),
-            CPS_TRY(get_optional<std::string>(root, "package", "version_schema").map([](auto && v) {
-                return string_to_schema(v.value_or("simple"));
-            })),
-        };
+        if (auto && p = load_compiled(path)) {
+            return std::move(p.value());
+        }
+        return load(path, default_backend);
+    }
+
+    tl::expected<Package, std::string> load(const fs::path & path, Backend backend) {
+        // A fresh buffer is used for each file rather than one being reused:
+        // holding a large allocation alive keeps glibc from raising its trim
+        // threshold, and freeing the jsoncpp document then returns memory to
+        // the OS on every load.
+        trace::Span span{"load"};
+        span.arg("path", path.native());
+        std::string contents = CPS_TRY(read_file(path));
+        span.arg("bytes", contents.size());
+        ++stats::counters.files_parsed;
+        stats::counters.bytes_read += contents.size();
+
+        Package p;
+        switch (backend) {
+        case Backend::jsoncpp:
+            p = CPS_TRY(load_jsoncpp(path, contents));
+            break;
+        case Backend::streaming:
+            // The package keeps the contents, which its unparsed components point into
+            p = CPS_TRY(load_streaming(path, std::make_shared<const std::string>(std::move(contents))));
+            break;
+        default:
+            CPS_UNREACHABLE("Unknown loader backend");
+            return tl::unexpected("Unknown loader backend");
+        }
+
+        parse_versions(p);
+        return p;
+    }
+
+    tl::expected<fs::path, std::string> compile(const fs::path & path) {
+        // The CPS file is stat'd before it is read, so that if it changes in
+        // between the compiled file is stale rather than wrong
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0) {
+            return tl::unexpected(fmt::format("Could not stat {}: {}", path.string(), std::strerror(errno)));
+        }
+        Package p = CPS_TRY(load(path, default_backend));
+        // Compiling is done ahead of time, so every component is parsed now
+        // rather than each time the compiled file is read
+        for (auto && [name, _] : p.components) {
+            CPS_TRY(p.get_component(name));
+        }
+        const std::string contents = CPS_TRY(binary::encode_file(p, source_of(st), path));
+
+        // Written to a temporary file and renamed into place, so that a
+        // compiled file is never seen half written
+        const fs::path compiled = binary::compiled_path(path);
+        std::string tmp = compiled.string() + ".XXXXXX";
+        const File file{::mkstemp(tmp.data())};
+        if (file.fd < 0) {
+            return tl::unexpected(fmt::format("Could not create {}: {}", tmp, std::strerror(errno)));
+        }
+        for (size_t written = 0; written < contents.size();) {
+            const ssize_t r = ::write(file.fd, contents.data() + written, contents.size() - written);
+            if (r < 0 && errno != EINTR) {
+                const std::string error = std::strerror(errno);
+                ::unlink(tmp.c_str());
+                return tl::unexpected(fmt::format("Could not write {}: {}", tmp, error));
+            }
+            written += r < 0 ? 0 : static_cast<size_t>(r);
+        }
+        if (::fchmod(file.fd, st.st_mode & 0666) != 0 || ::rename(tmp.c_str(), compiled.c_str()) != 0) {
+            const std::string error = std::strerror(errno);
+            ::unlink(tmp.c_str());
+            return tl::unexpected(fmt::format("Could not write {}: {}", compiled.string(), error));
+        }
+        return compiled;
     }
 } // namespace cps::loader
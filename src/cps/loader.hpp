@@ -10,8 +10,10 @@
 #include <tl/expected.hpp>
 
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -82,6 +84,12 @@ namespace cps::loader {
         std::optional<std::string> location;
         std::optional<std::string> link_location;
         std::vector<std::string> require; // requires is a keyword
+
+        /// @brief The JSON of a component that has not been parsed yet
+        ///
+        /// When this is set none of the other fields have been filled in, use
+        /// Package::get_component to parse it.
+        std::optional<std::string_view> raw;
     };
 
     class Configuration {
@@ -111,6 +119,8 @@ namespace cps::loader {
         std::vector<std::string> components;
         // TODO: Hints
         std::optional<std::string> version;
+        /// @brief version, if it is valid in the simple schema
+        std::optional<version::Version> parsed_version;
     };
 
     using Requires = std::unordered_map<std::string, Requirement>;
@@ -137,12 +147,13 @@ namespace cps::loader {
         Package();
         Package(std::string name, std::string cps_version, std::unordered_map<std::string, Component> && components,
                 std::string cps_path, std::optional<std::vector<std::string>> && default_comps, Requires require,
-                std::optional<std::string> version, version::Schema schema);
+                std::optional<std::string> version, std::optional<std::string> compat_version,
+                version::Schema schema);
 
         std::string name;
         std::string cps_version;
         std::unordered_map<std::string, Component> components;
-        // TODO: compat-version
+        std::optional<std::string> compat_version;
         // TODO: configuration
         // TODO: configurations
         std::string cps_path;
@@ -151,8 +162,53 @@ namespace cps::loader {
         Requires require; // Requires is a keyword
         std::optional<std::string> version;
         version::Schema version_schema;
+        /// @brief version, if the schema is simple and it is valid
+        std::optional<version::Version> parsed_version;
+
+        /// @brief The contents of the CPS file, if any components point into it
+        std::shared_ptr<const std::string> source;
+
+        /// @brief Get a component, parsing it first if it has not been yet
+        /// @param name The name of the component
+        /// @return A pointer to the component, valid as long as the Package is
+        tl::expected<const Component *, std::string> get_component(const std::string & name);
     };
 
+    /// @brief The JSON parsers that CPS files can be loaded with
+    enum class Backend {
+        /// @brief Parse into a jsoncpp document, then convert that
+        jsoncpp,
+        /// @brief Fill in the Package while tokenizing the file
+        streaming,
+    };
+
+    /// @brief Parse every version in the package once, so that resolving
+    ///        can compare them without parsing them again
+    ///
+    /// A version which isn't valid is left unparsed, and is reported when
+    /// something tries to compare it. load() calls this, anything else that
+    /// creates a Package must too.
+    void parse_versions(Package & p);
+
+    /// @brief Load a CPS file
+    ///
+    /// If the CPS file has been compiled, and hasn't changed since, the
+    /// compiled file is read and decoded instead. Otherwise the CPS file is
+    /// parsed with the backend selected at configure time.
     tl::expected<Package, std::string> load(const std::filesystem::path & path);
 
+    /// @brief Parse a CPS file with the given backend, ignoring any compiled file
+    tl::expected<Package, std::string> load(const std::filesystem::path & path, Backend backend);
+
+    /// @brief Compile a CPS file into a binary cache, so that loading it doesn't need to parse the JSON
+    ///
+    /// The compiled file is written next to the CPS file, see
+    /// binary::compiled_path. It is only used while the CPS file's size and
+    /// modification time are unchanged. Loading it still reads the whole
+    /// file and copies every value into a Package, it only skips the
+    /// tokenizing, see binary::decode_file.
+    ///
+    /// @return The compiled file
+    tl::expected<std::filesystem::path, std::string> compile(const std::filesystem::path & path);
+
 } // namespace cps::loader
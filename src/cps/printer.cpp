@@ -5,17 +5,21 @@
 #include "cps/printer.hpp"
 
 #include "cps/error.hpp"
+#include "cps/trace.hpp"
 
 #include <fmt/format.h>
 #include <tl/expected.hpp>
 
+#include <iterator>
+
 namespace cps::printer {
 
-    int pkgconf(const search::Result & r, const Config & conf) {
+    int pkgconf(const search::Result & r, const Config & conf, std::string & out) {
+        trace::Span span{"pkgconf"};
         std::vector<std::string> args{};
 
         if (conf.mod_version) {
-            fmt::print("{}\n", r.version);
+            fmt::format_to(std::back_inserter(out), "{}\n", r.version);
             return 0;
         }
 
@@ -65,7 +69,7 @@ namespace cps::printer {
             }
         }
 
-        fmt::print("{}\n", fmt::join(args, " "));
+        fmt::format_to(std::back_inserter(out), "{}\n", fmt::join(args, " "));
         return 0;
     }
 
@@ -6,6 +6,8 @@
 
 #include "cps/search.hpp"
 
+#include <string>
+
 namespace cps::printer {
 
     struct Config {
@@ -18,6 +20,8 @@ namespace cps::printer {
         bool mod_version = false;
     };
 
-    int pkgconf(const search::Result & dag, const Config & conf);
+    /// @brief Format a result the way pkg-config would
+    /// @param out The formatted flags are appended to this
+    int pkgconf(const search::Result & dag, const Config & conf, std::string & out);
 
 } // namespace cps::printer
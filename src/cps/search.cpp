@@ -5,18 +5,30 @@
 #include "cps/search.hpp"
 
 #include "cps/error.hpp"
+#include "cps/index.hpp"
 #include "cps/loader.hpp"
+#include "cps/stats.hpp"
+#include "cps/trace.hpp"
 #include "cps/utils.hpp"
 #include "cps/version.hpp"
 
-#include <fmt/core.h>
+#include <fmt/format.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
 #include <deque>
 #include <filesystem>
-#include <memory>
+#include <future>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <unordered_set>
+#include <utility>
 
 namespace fs = std::filesystem;
 
@@ -36,64 +48,106 @@ namespace cps::search {
             std::vector<std::string> components;
         };
 
+        /// @brief Index of a Node in a Graph
+        using NodeId = uint32_t;
+
         /// @brief A DAG node
         class Node {
           public:
-            Node(Dependency obj) : data{std::move(obj)} {};
             Node(loader::Package obj) : data{std::move(obj)} {};
 
             Dependency data;
-            std::vector<std::shared_ptr<Node>> depends;
+            /// @brief The packages required by the selected components
+            std::vector<NodeId> required;
         };
 
-        void dfs(const std::shared_ptr<Node> & node, std::unordered_set<std::shared_ptr<Node>> & visited,
-                 std::deque<std::shared_ptr<Node>> & sorted) {
-            visited.emplace(node);
-            for (auto && d : node->depends) {
-                if (visited.find(d) == visited.end()) {
-                    dfs(d, visited, sorted);
-                }
+        /// @brief The dependency graph of a single query
+        ///
+        /// Nodes live in one contiguous arena and refer to each other by
+        /// index. References to a Node are invalidated by add(), so hold on to
+        /// the NodeId instead.
+        class Graph {
+          public:
+            NodeId add(loader::Package && package) {
+                nodes.emplace_back(std::move(package));
+                return static_cast<NodeId>(nodes.size() - 1);
             }
-            sorted.emplace_front(node);
-        }
+
+            Node & operator[](NodeId id) { return nodes[id]; }
+            const Node & operator[](NodeId id) const { return nodes[id]; }
+
+            size_t size() const { return nodes.size(); }
+
+          private:
+            std::vector<Node> nodes;
+        };
 
         /// @brief Perform a topological sort of the DAG
-        /// @param root The root Node
-        /// @return A linear topological sorting of the DAG
-        std::vector<std::shared_ptr<Node>> tsort(const std::shared_ptr<Node> & root) {
-            std::deque<std::shared_ptr<Node>> sorted;
-            std::unordered_set<std::shared_ptr<Node>> visited;
-            dfs(root, visited, sorted);
-
-            std::vector<std::shared_ptr<Node>> out{};
-            out.insert(out.end(), sorted.begin(), sorted.end());
-            return out;
-        }
+        /// @param graph The graph to sort
+        /// @param roots The root Nodes, in the order they were asked for
+        /// @return A linear topological sorting of the nodes reachable from the roots, or an error if they form a cycle
+        tl::expected<std::vector<NodeId>, std::string> tsort(const Graph & graph, const std::vector<NodeId> & roots) {
+            trace::Span span{"tsort"};
+            // A node is visited once it has been pushed, and active while it
+            // is on the stack. Reaching an active node again means a cycle.
+            std::vector<bool> visited(graph.size());
+            std::vector<bool> active(graph.size());
 
-        const std::vector<fs::path> nix{"/usr", "/usr/local"};
-        // TODO: const std::vector<std::string> mac{""};
-        // TODO: const std::vector<std::string> win{""};
+            // Each frame is a node and the index of the next edge to follow
+            std::vector<std::pair<NodeId, size_t>> stack;
 
-        std::vector<fs::path> cached_paths{};
+            std::vector<NodeId> sorted;
+            sorted.reserve(graph.size());
 
-        const std::vector<fs::path> search_paths() {
-            if (!cached_paths.empty()) {
-                return cached_paths;
-            }
+            // The output is reversed at the end, so walking the roots last to
+            // first puts the first root first. A dependency shared between
+            // roots is still only emitted after all of them.
+            for (auto root = roots.rbegin(); root != roots.rend(); ++root) {
+                if (visited[*root]) {
+                    continue;
+                }
+                stack.emplace_back(*root, 0);
+                visited[*root] = true;
+                active[*root] = true;
 
-            if (const char * env_c = std::getenv("CPS_PATH")) {
-                cached_paths.reserve(nix.size());
-                cached_paths.insert(cached_paths.end(), nix.begin(), nix.end());
-                auto && env = utils::split(env_c);
-                cached_paths.reserve(env.size());
-                cached_paths.insert(cached_paths.end(), env.begin(), env.end());
-            } else {
-                cached_paths = nix;
+                while (!stack.empty()) {
+                    auto & [id, edge] = stack.back();
+                    const std::vector<NodeId> & required = graph[id].required;
+                    if (edge == required.size()) {
+                        active[id] = false;
+                        sorted.emplace_back(id);
+                        stack.pop_back();
+                        continue;
+                    }
+
+                    const NodeId next = required[edge++];
+                    if (active[next]) {
+                        std::vector<std::string> cycle;
+                        auto && start =
+                            std::find_if(stack.begin(), stack.end(), [next](auto && f) { return f.first == next; });
+                        for (auto it = start; it != stack.end(); ++it) {
+                            cycle.emplace_back(graph[it->first].data.package.name);
+                        }
+                        cycle.emplace_back(graph[next].data.package.name);
+                        return tl::unexpected(fmt::format("Dependency cycle detected: {}", fmt::join(cycle, " -> ")));
+                    }
+                    if (!visited[next]) {
+                        visited[next] = true;
+                        active[next] = true;
+                        stack.emplace_back(next, 0);
+                    }
+                }
             }
 
-            return cached_paths;
+            // Nodes were emitted after everything they require, dependees must come first
+            std::reverse(sorted.begin(), sorted.end());
+            return sorted;
         }
 
+        const std::vector<fs::path> nix{"/usr", "/usr/local"};
+        // TODO: const std::vector<std::string> mac{""};
+        // TODO: const std::vector<std::string> win{""};
+
         const fs::path libdir() {
             // TODO: libdir needs to be configurable based on the personality,
             //       and different name schemes.
@@ -105,10 +159,16 @@ namespace cps::search {
         /// @brief Find all possible paths for a given CPS name
         /// @param name The name of the CPS file to find
         /// @return A vector of paths which patch the given name, or an error
-        tl::expected<std::vector<fs::path>, std::string> find_paths(std::string_view name) {
-            // If a path is passed, then just return that.
-            if (fs::is_regular_file(name)) {
-                return std::vector<fs::path>{name};
+        tl::expected<std::vector<fs::path>, std::string> find_paths(const Context & context, std::string_view name) {
+            trace::Span span{"find_paths"};
+            span.arg("name", name);
+            // If a path is passed, then just return that. A bare name is
+            // never a path, so looking it up doesn't touch the filesystem.
+            if (name.find('/') != std::string_view::npos || fs::path{name}.extension() == ".cps") {
+                ++stats::counters.files_stated;
+                if (fs::is_regular_file(name)) {
+                    return std::vector<fs::path>{name};
+                }
             }
 
             // TODO: Need something like pkgconf's --personality option
@@ -116,23 +176,7 @@ namespace cps::search {
             // a file
             // TODO: what to do about finding multiple versions of the same
             // dependency?
-            auto && paths = search_paths();
-            std::vector<fs::path> found{};
-            for (auto && prefix : paths) {
-                // TODO: <prefix>/<libdir>/cps/<name-like>/
-                // TODO: <prefix>/share/cps/<name-like>/
-                // TODO: <prefix>/share/cps/
-
-                const fs::path dir = prefix / libdir() / "cps";
-                if (fs::is_directory(dir)) {
-                    // TODO: <name-like>
-                    const fs::path file = dir / fmt::format("{}.cps", name);
-                    if (fs::is_regular_file(file)) {
-                        found.push_back(file);
-                    }
-                }
-            }
-
+            std::vector<fs::path> found = context.find(name);
             if (found.empty()) {
                 return tl::unexpected(fmt::format("Could not find a CPS file for {}", name));
             }
@@ -147,108 +191,542 @@ namespace cps::search {
             ProcessedRequires(std::string s) : components{{std::move(s)}}, defaults{false} {};
         };
 
+        using RequiresList = std::vector<std::pair<std::string, ProcessedRequires>>;
+
         /// @brief Extract all required dependencies with their components
         /// @param components The requested componenets
-        /// @return a map of dependency to (components[], use_defaults)
-        std::unordered_map<std::string, ProcessedRequires>
-        process_requires(const std::vector<std::string> & components) {
-            std::unordered_map<std::string, ProcessedRequires> map;
+        /// @return dependency to (components[], use_defaults), in the order they were first required
+        RequiresList process_requires(const std::vector<std::string> & components) {
+            RequiresList map;
+            const auto && find = [&map](const std::string & n) {
+                return std::find_if(map.begin(), map.end(), [&n](auto && e) { return e.first == n; });
+            };
             for (auto && c : components) {
                 std::vector<std::string> vals = utils::split(c);
                 if (vals.size() == 1) {
                     // In this case we want to use the default components
                     // TODO: it's probably an error for one CPS file to specify
                     // the same component with default and non-default?
-                    if (auto x = map.find(vals[0]); x != map.end()) {
+                    if (auto x = find(vals[0]); x != map.end()) {
                         /// XXX: blarg this is ugly
                         x->second.defaults = true;
                     } else {
-                        map.emplace(vals[0], ProcessedRequires{true});
+                        map.emplace_back(vals[0], ProcessedRequires{true});
                     }
                 } else {
                     // "" is a special value that means "this dependency"
-                    if (auto x = map.find(vals[0]); x != map.end()) {
+                    if (auto x = find(vals[0]); x != map.end()) {
                         /// XXX: blarg this is ugly
                         x->second.components.emplace_back(vals[1]);
                     } else {
-                        map.emplace(vals[0], vals[1]);
+                        map.emplace_back(vals[0], vals[1]);
                     }
                 }
             }
             return map;
         }
 
-        class NodeFactory {
+        /// @brief A few threads which load CPS files for a single query
+        ///
+        /// The threads are only started when the first load is submitted, so a
+        /// query which never loads two packages at once never starts one.
+        class LoadPool {
           public:
-            NodeFactory() = default;
+            using Loaded = std::future<tl::expected<loader::Package, std::string>>;
 
-            tl::expected<std::shared_ptr<Node>, std::string> get(std::string_view name, const fs::path & path) {
-                if (auto && hit = cache.find(std::string{name}); hit != cache.end()) {
-                    return hit->second;
+            LoadPool(const Loader & load_) : load{load_} {};
+            LoadPool(const LoadPool &) = delete;
+            LoadPool & operator=(const LoadPool &) = delete;
+
+            /// @brief Any loads which haven't started yet are abandoned
+            ~LoadPool() {
+                {
+                    const std::lock_guard<std::mutex> guard{lock};
+                    stopping = true;
+                }
+                ready.notify_all();
+                for (auto && t : threads) {
+                    t.join();
                 }
-                auto n = std::make_shared<Node>(CPS_TRY(loader::load(path)));
+            }
 
-                cache.emplace(name, n);
-                return n;
+            /// @brief Load a CPS file on one of the threads
+            Loaded submit(fs::path path) {
+                std::packaged_task<tl::expected<loader::Package, std::string>()> task{
+                    [this, path = std::move(path)]() { return load(path); }};
+                Loaded loaded = task.get_future();
+                {
+                    const std::lock_guard<std::mutex> guard{lock};
+                    queue.emplace_back(std::move(task));
+                    if (threads.size() < thread_count()) {
+                        threads.emplace_back([this]() { work(); });
+                    }
+                }
+                ready.notify_one();
+                return loaded;
             }
 
           private:
-            std::unordered_map<std::string, std::shared_ptr<Node>> cache;
+            /// @brief Loading is mostly waiting on the filesystem, so a few
+            ///        threads are enough to hide it, even on a single core
+            static size_t thread_count() { return std::clamp<size_t>(std::thread::hardware_concurrency(), 4, 8); }
+
+            void work() {
+                while (true) {
+                    std::packaged_task<tl::expected<loader::Package, std::string>()> task;
+                    {
+                        std::unique_lock<std::mutex> guard{lock};
+                        ready.wait(guard, [this]() { return stopping || !queue.empty(); });
+                        if (stopping) {
+                            return;
+                        }
+                        task = std::move(queue.front());
+                        queue.pop_front();
+                    }
+                    task();
+                }
+            }
+
+            const Loader & load;
+            std::mutex lock;
+            std::condition_variable ready;
+            std::deque<std::packaged_task<tl::expected<loader::Package, std::string>()>> queue;
+            std::vector<std::thread> threads;
+            bool stopping = false;
+        };
+
+        /// @brief State shared by every step of a single query
+        ///
+        /// The graph is built from the requested components outwards: a
+        /// package is only found and loaded once a selected component actually
+        /// requires it, so dependencies which are listed in a package's
+        /// Requires but not used by any selected component are never read.
+        ///
+        /// Packages are memoized by path, so that each CPS file is read and
+        /// parsed at most once per query, even when it is reachable through
+        /// several dependees (a diamond). The result of finding a name with a
+        /// given set of requirements is memoized as well.
+        ///
+        /// The graph is only ever built on the calling thread, in the order
+        /// the CPS files list their requirements, so the result is the same
+        /// however the loads are scheduled. Only the loading itself is spread
+        /// over threads: before the components selected from a package are
+        /// walked, every package they require which hasn't been loaded yet is
+        /// handed to the pool, so reading and parsing them overlaps with
+        /// walking the first.
+        class Resolver {
+          public:
+            Resolver(const Context & context_, const Loader & load_, Graph & graph_)
+                : context{context_}, load{load_}, graph{graph_}, pool{load_} {};
+
+            /// @brief Start loading the packages that will be needed to satisfy some requirements
+            ///
+            /// Nothing is gained unless there are at least two, since the
+            /// calling thread would immediately wait for a single one.
+            void prefetch(const std::vector<std::pair<std::string_view, const loader::Requirement *>> & wanted);
+
+            /// @brief Start loading the packages required by some components of a node
+            void prefetch(NodeId id, const std::vector<std::string> & components);
+
+            /// @brief Find the package which best satisfies a requirement
+            ///
+            /// This does not look at the dependencies of the package, that is
+            /// done as components are added to it.
+            tl::expected<NodeId, std::string> find(std::string_view name, const loader::Requirement & requirements);
+
+            /// @brief Select components of a package, and find everything they require
+            /// @param node The node to add components to
+            /// @param components the components required from this node
+            /// @param default_components Whether to also select the default components
+            ///
+            /// A node may be reached through several dependees which each want
+            /// different components from it, so this only ever adds to the
+            /// components and required dependencies already selected for a node.
+            tl::expected<void, std::string> add_components(NodeId id, const std::vector<std::string> & components,
+                                                           bool default_components);
+
+            /// @brief Find each of the named packages, and select their components
+            ///
+            /// A package whose selected components require something that
+            /// can't be found is rejected, like one which is too old, and the
+            /// next candidate is tried instead. Any choice made so far may
+            /// have led to the rejected package, so every choice is made again
+            /// without it. Each retry rejects at least one more package, so
+            /// this ends.
+            tl::expected<std::vector<NodeId>, std::string> roots(const std::vector<std::string> & names,
+                                                                 const std::vector<std::string> & components,
+                                                                 bool default_components);
+
+          private:
+            /// @brief A node whose components are being added
+            struct Frame {
+                NodeId id;
+                /// @brief The components to select, which grows as components require others of this node
+                std::vector<std::string> wanted;
+                /// @brief The index of the next component to select
+                size_t next;
+                /// @brief The components before this index have had their requirements prefetched
+                size_t prefetched;
+                /// @brief What the last component selected requires
+                RequiresList required;
+                /// @brief The index of the next requirement to walk
+                size_t next_required;
+            };
+
+            /// @brief The frame for adding components to a node, see add_components
+            Frame frame(NodeId id, const std::vector<std::string> & components, bool default_components) const;
+
+            tl::expected<NodeId, std::string> get(const fs::path & path);
+            tl::expected<NodeId, std::string> resolve(std::string_view name, const loader::Requirement & requirements);
+            const tl::expected<std::vector<fs::path>, std::string> & paths(std::string_view name);
+
+            /// @brief Undo every choice, but keep the packages loaded
+            void reset();
+
+            /// @brief Reject the nodes on a stack whose dependencies can't be found
+            ///
+            /// The top node is rejected, then each dependee below it which has
+            /// no other candidate to fall back on.
+            void reject(const std::vector<Frame> & stack);
+
+            const Context & context;
+            const Loader & load;
+            Graph & graph;
+            /// @brief Packages which can't be used, as something they require can't be found
+            std::unordered_set<NodeId> rejected;
+            std::unordered_map<std::string, tl::expected<NodeId, std::string>> packages;
+            std::unordered_map<std::string, tl::expected<NodeId, std::string>> nodes;
+            std::unordered_map<std::string, tl::expected<std::vector<fs::path>, std::string>> found;
+            /// @brief Packages being loaded by the pool, which haven't been added to the graph yet
+            std::unordered_map<std::string, LoadPool::Loaded> loading;
+            // Last, so that its threads are stopped before anything they use is destroyed
+            LoadPool pool;
         };
 
-        tl::expected<std::shared_ptr<Node>, std::string>
-        build_node(std::string_view name, const loader::Requirement & requirements, NodeFactory factory) {
-            const std::vector<fs::path> paths = CPS_TRY(find_paths(name));
-            for (auto && path : paths) {
+        /// @brief Whether a CPS file might satisfy a requirement
+        ///
+        /// A CPS file the index knows lacks some of the required components
+        /// can be skipped without loading it, as long as it hasn't changed
+        /// since the index was built.
+        bool may_satisfy(const Context & context, const fs::path & path, const loader::Requirement & requirements) {
+            if (requirements.components.empty()) {
+                return true;
+            }
+            if (auto && e = context.indexed(path); e && e->loaded && index::current(e.value())) {
+                return std::all_of(requirements.components.begin(), requirements.components.end(), [e](auto && c) {
+                    return std::find(e->components.begin(), e->components.end(), c) != e->components.end();
+                });
+            }
+            return true;
+        }
+
+        const tl::expected<std::vector<fs::path>, std::string> & Resolver::paths(std::string_view name) {
+            std::string key{name};
+            if (auto && hit = found.find(key); hit != found.end()) {
+                return hit->second;
+            }
+            auto && p = find_paths(context, name);
+            return found.emplace(std::move(key), std::move(p)).first->second;
+        }
+
+        void Resolver::prefetch(const std::vector<std::pair<std::string_view, const loader::Requirement *>> & wanted) {
+            // Without a version to check, the first candidate is the one
+            // chosen unless it is broken. With one, an older copy may be
+            // rejected, so every candidate is loaded rather than finding out
+            // one at a time.
+            std::vector<fs::path> files;
+            for (auto && [name, requirements] : wanted) {
+                auto && candidates = paths(name);
+                if (!candidates) {
+                    continue;
+                }
+                for (auto && p : candidates.value()) {
+                    if (!may_satisfy(context, p, *requirements)) {
+                        continue;
+                    }
+                    if (!packages.count(p.string()) && !loading.count(p.string()) &&
+                        std::find(files.begin(), files.end(), p) == files.end()) {
+                        files.emplace_back(p);
+                    }
+                    if (!requirements->version) {
+                        break;
+                    }
+                }
+            }
+            if (files.size() < 2) {
+                return;
+            }
+            for (auto && f : files) {
+                std::string key = f.string();
+                loading.emplace(std::move(key), pool.submit(std::move(f)));
+            }
+        }
 
-                auto maybe_node = factory.get(name, path);
-                if (!maybe_node) {
+        void Resolver::prefetch(NodeId id, const std::vector<std::string> & components) {
+            loader::Package & package = graph[id].data.package;
+            const std::vector<std::string> & selected = graph[id].data.components;
+            std::vector<RequiresList> required;
+            for (auto && c : components) {
+                if (std::find(selected.begin(), selected.end(), c) != selected.end()) {
                     continue;
                 }
-                auto node = maybe_node.value();
-                const loader::Package & p = node->data.package;
+                // An invalid component is reported when it is walked
+                if (auto && component = package.get_component(c)) {
+                    required.emplace_back(process_requires(component.value()->require));
+                }
+            }
+
+            std::vector<std::pair<std::string_view, const loader::Requirement *>> wanted;
+            for (auto && list : required) {
+                for (auto && [name, _] : list) {
+                    if (auto && req = package.require.find(name); !name.empty() && req != package.require.end()) {
+                        wanted.emplace_back(name, &req->second);
+                    }
+                }
+            }
+            prefetch(wanted);
+        }
+
+        tl::expected<NodeId, std::string> Resolver::get(const fs::path & path) {
+            if (auto && hit = packages.find(path.string()); hit != packages.end()) {
+                return hit->second;
+            }
+            tl::expected<loader::Package, std::string> p;
+            if (auto && pending = loading.find(path.string()); pending != loading.end()) {
+                p = pending->second.get();
+                loading.erase(pending);
+            } else {
+                p = load(path);
+            }
+            auto && n = std::move(p).map([this](loader::Package && pkg) { return graph.add(std::move(pkg)); });
+            return packages.emplace(path.string(), std::move(n)).first->second;
+        }
+
+        tl::expected<NodeId, std::string> Resolver::find(std::string_view name,
+                                                         const loader::Requirement & requirements) {
+            // The components are sorted so that requirements which only differ
+            // in order share a cache entry
+            std::vector<std::string> comps = requirements.components;
+            std::sort(comps.begin(), comps.end());
+            std::string key = fmt::format("{}\n{}\n{}", name, requirements.version.value_or(""), fmt::join(comps, ","));
+
+            if (auto && hit = nodes.find(key); hit != nodes.end()) {
+                ++stats::counters.node_cache_hits;
+                return hit->second;
+            }
+            ++stats::counters.node_cache_misses;
+            auto && n = resolve(name, requirements);
+            return nodes.emplace(std::move(key), std::move(n)).first->second;
+        }
+
+        tl::expected<NodeId, std::string> Resolver::resolve(std::string_view name,
+                                                            const loader::Requirement & requirements) {
+            trace::Span span{"resolve"};
+            span.arg("name", name);
+            const std::vector<fs::path> & candidates = CPS_TRY(paths(name));
+            for (auto && path : candidates) {
+                // Skip loading candidates the index already knows can't satisfy the requirements
+                if (!may_satisfy(context, path, requirements)) {
+                    continue;
+                }
+
+                auto maybe_node = get(path);
+                if (!maybe_node || rejected.count(maybe_node.value())) {
+                    continue;
+                }
+                const NodeId id = maybe_node.value();
+                const loader::Package & p = graph[id].data.package;
 
                 // If this package doesn't meet the requirements then reject it and continue on.
                 // The conditions it could fail to meet are:
                 //  1. the provided version (or Compat-Version) is < the required version
                 //  2. This package lacks required components
                 if (p.version && requirements.version) {
-                    if (version::compare(p.version.value_or("0"), version::Operator::lt,
-                                         requirements.version.value_or("0"), p.version_schema)) {
+                    // A version which can't be compared can't be shown to satisfy the requirement
+                    bool older = true;
+                    ++stats::counters.version_comparisons;
+                    if (p.parsed_version && requirements.parsed_version) {
+                        older = version::compare(p.parsed_version.value(), version::Operator::lt,
+                                                 requirements.parsed_version.value());
+                    } else if (auto && r = version::compare(p.version.value(), version::Operator::lt,
+                                                            requirements.version.value(), p.version_schema);
+                               r) {
+                        older = r.value();
+                    }
+                    if (older) {
                         continue;
                     }
                 }
 
                 if (!std::all_of(requirements.components.begin(), requirements.components.end(),
-                                 [p](const std::string & c) { return p.components.find(c) != p.components.end(); })) {
+                                 [&p](const std::string & c) { return p.components.find(c) != p.components.end(); })) {
                     continue;
                 }
 
-                std::vector<std::shared_ptr<Node>> found;
-                found.reserve(p.require.size());
-                for (auto && [n, r] : p.require) {
-                    auto && child = build_node(n, r, factory);
-                    if (child) {
-                        found.emplace_back(child.value());
-                    } else {
-                        break;
+                return id;
+            }
+
+            return tl::unexpected(fmt::format("Could not find a dependency to satisfy {}", name));
+        }
+
+        Resolver::Frame Resolver::frame(NodeId id, const std::vector<std::string> & components,
+                                        bool default_components) const {
+            Frame f{id, {}, 0, 0, {}, 0};
+            const std::optional<std::vector<std::string>> & defaults = graph[id].data.package.default_components;
+            if (default_components && defaults) {
+                f.wanted.insert(f.wanted.end(), defaults->begin(), defaults->end());
+            }
+            f.wanted.insert(f.wanted.end(), components.begin(), components.end());
+            return f;
+        }
+
+        tl::expected<void, std::string> Resolver::add_components(NodeId id, const std::vector<std::string> & components,
+                                                                 bool default_components) {
+            trace::Span span{"add_components"};
+            span.arg("package", graph[id].data.package.name);
+
+            // A chain of dependencies can be tens of thousands of packages
+            // long, which is too deep to recurse, so each package being
+            // walked is a frame on this stack instead. The top frame's
+            // dependencies are walked to the end before it moves on to its
+            // next component, as they would be by recursing.
+            std::vector<Frame> stack;
+            stack.emplace_back(frame(id, components, default_components));
+            while (!stack.empty()) {
+                Frame & f = stack.back();
+
+                // Only the packages this component needs are found, anything
+                // else listed in the Package::Requires section is never
+                // loaded. Walk them in the order the component lists them so
+                // that the output order is stable.
+                if (f.next_required < f.required.size()) {
+                    auto && [dep_name, child_comps] = f.required[f.next_required++];
+                    if (dep_name.empty()) {
+                        continue;
                     }
+                    // Finding a dependency may grow the arena, so the node is
+                    // looked up again after each call to find rather than held
+                    // by reference
+                    const loader::Requires & listed = graph[f.id].data.package.require;
+                    auto && req = listed.find(dep_name);
+                    if (req == listed.end()) {
+                        continue;
+                    }
+                    auto && child_id = find(dep_name, req->second);
+                    if (!child_id) {
+                        reject(stack);
+                        return tl::unexpected(child_id.error());
+                    }
+                    const NodeId child = child_id.value();
+                    std::vector<NodeId> & edges = graph[f.id].required;
+                    if (std::find(edges.begin(), edges.end(), child) == edges.end()) {
+                        edges.emplace_back(child);
+                    }
+                    // This invalidates f
+                    stack.emplace_back(frame(child, child_comps.components, child_comps.defaults));
+                    continue;
+                }
+
+                if (f.next == f.wanted.size()) {
+                    stack.pop_back();
+                    continue;
+                }
+
+                // Everything the components not seen yet require starts
+                // loading now, so that it loads while the first requirement is
+                // walked
+                if (f.next == f.prefetched) {
+                    prefetch(f.id, {f.wanted.begin() + static_cast<std::ptrdiff_t>(f.next), f.wanted.end()});
+                    f.prefetched = f.wanted.size();
                 }
-                if (found.size() < p.require.size()) {
+
+                const std::string c_name = f.wanted[f.next++];
+                std::vector<std::string> & selected = graph[f.id].data.components;
+                if (std::find(selected.begin(), selected.end(), c_name) != selected.end()) {
                     continue;
                 }
+                selected.emplace_back(c_name);
 
-                node->depends.insert(node->depends.end(), found.begin(), found.end());
-                return node;
+                // Components are parsed on first use, so this is where an
+                // invalid component is reported
+                const loader::Component * component = CPS_TRY(graph[f.id].data.package.get_component(c_name));
+                f.required = process_requires(component->require);
+                f.next_required = 0;
+
+                // "" is a special value that means "this dependency"
+                if (auto && self = std::find_if(f.required.begin(), f.required.end(),
+                                                [](auto && e) { return e.first.empty(); });
+                    self != f.required.end()) {
+                    const std::optional<std::vector<std::string>> & own = graph[f.id].data.package.default_components;
+                    if (self->second.defaults && own) {
+                        f.wanted.insert(f.wanted.end(), own->begin(), own->end());
+                    }
+                    f.wanted.insert(f.wanted.end(), self->second.components.begin(), self->second.components.end());
+                }
             }
 
-            return tl::unexpected(fmt::format("Could not find a dependency to satisfy {}", name));
+            return {};
         }
 
-        tl::expected<std::shared_ptr<Node>, std::string> build_node(std::string_view name,
-                                                                    const loader::Requirement & requirements) {
-            NodeFactory factory{};
-            return build_node(name, requirements, factory);
+        void Resolver::reject(const std::vector<Frame> & stack) {
+            for (size_t i = stack.size(); i-- > 0;) {
+                rejected.insert(stack[i].id);
+                if (i == 0) {
+                    break;
+                }
+                // The node was found for the requirement its dependee walked
+                // last, which may be met by another candidate now
+                const Frame & parent = stack[i - 1];
+                const std::string & name = parent.required[parent.next_required - 1].first;
+                nodes.clear();
+                if (find(name, graph[parent.id].data.package.require.at(name))) {
+                    break;
+                }
+            }
+        }
+
+        void Resolver::reset() {
+            nodes.clear();
+            for (NodeId id = 0; id < graph.size(); ++id) {
+                graph[id].data.components.clear();
+                graph[id].required.clear();
+            }
+        }
+
+        tl::expected<std::vector<NodeId>, std::string> Resolver::roots(const std::vector<std::string> & names,
+                                                                       const std::vector<std::string> & components,
+                                                                       bool default_components) {
+            const loader::Requirement wanted{components};
+            // What was missing when the first package was rejected, which
+            // says more than a dependee running out of candidates because of it
+            std::optional<std::string> missing;
+            while (true) {
+                const size_t before = rejected.size();
+                std::vector<NodeId> found_roots;
+                found_roots.reserve(names.size());
+                tl::expected<void, std::string> r;
+                for (auto && name : names) {
+                    // XXX: do we need process_requires here?
+                    auto && root = find(name, wanted);
+                    if (!root) {
+                        return tl::unexpected(missing.value_or(root.error()));
+                    }
+                    if (r = add_components(root.value(), components, default_components); !r) {
+                        break;
+                    }
+                    found_roots.emplace_back(root.value());
+                }
+                if (r) {
+                    return found_roots;
+                }
+                if (rejected.size() == before) {
+                    return tl::unexpected(r.error());
+                }
+                if (!missing) {
+                    missing = r.error();
+                }
+                reset();
+            }
         }
 
         template <typename T, typename U>
@@ -259,10 +737,9 @@ namespace cps::search {
             }
         }
 
-        template <typename T, typename U>
+        template <typename T, typename U, typename F>
         void merge_result(const std::unordered_map<T, std::vector<U>> & input,
-                          std::unordered_map<T, std::vector<U>> & output,
-                          const std::function<U(const U &)> transformer) {
+                          std::unordered_map<T, std::vector<U>> & output, const F & transformer) {
             for (auto && [l, vals] : input) {
                 std::transform(vals.begin(), vals.end(), std::back_inserter(output[l]), transformer);
             }
@@ -278,6 +755,76 @@ namespace cps::search {
             }
         }
 
+        /// @brief Remove repeated values, keeping only the first or last occurrence of each
+        /// @param key_of Gives the value to compare, which must be hashable
+        template <typename T, typename KeyFn>
+        void dedup(std::vector<T> & values, bool keep_last, KeyFn && key_of) {
+            using Key = std::decay_t<std::invoke_result_t<KeyFn, const T &>>;
+
+            // Decide what to keep before moving anything, since the keys may
+            // point into the values
+            std::vector<bool> keep(values.size());
+            {
+                std::unordered_set<Key> seen;
+                seen.reserve(values.size());
+                for (size_t n = 0; n < values.size(); ++n) {
+                    const size_t i = keep_last ? values.size() - 1 - n : n;
+                    keep[i] = seen.insert(key_of(values[i])).second;
+                }
+            }
+
+            size_t out = 0;
+            for (size_t i = 0; i < values.size(); ++i) {
+                if (keep[i]) {
+                    if (out != i) {
+                        values[out] = std::move(values[i]);
+                    }
+                    ++out;
+                }
+            }
+            values.erase(values.begin() + out, values.end());
+        }
+
+        std::string_view as_key(const std::string & s) { return s; }
+
+        /// @brief The number of flags a result will be printed as
+        uint64_t count_flags(const Result & result) {
+            uint64_t count = result.link_location.size() + result.link_libraries.size();
+            for (auto && [_, v] : result.includes) {
+                count += v.size();
+            }
+            for (auto && [_, v] : result.defines) {
+                count += v.size();
+            }
+            for (auto && [_, v] : result.compile_flags) {
+                count += v.size();
+            }
+            return count;
+        }
+
+        /// @brief Remove repeated flags from a result, the way pkg-config does
+        ///
+        /// The first -I and -D of each value are kept. For libraries the last
+        /// is kept instead, as a library has to come after everything which
+        /// uses it. Other compile flags are left alone, since some of them
+        /// take the next flag as an argument.
+        void dedup_flags(Result & result) {
+            trace::Span span{"dedup_flags"};
+            stats::counters.flags_before_dedup += count_flags(result);
+            for (auto && [_, includes] : result.includes) {
+                dedup(includes, false, as_key);
+            }
+            for (auto && [_, defines] : result.defines) {
+                dedup(defines, false, [](const loader::Define & d) {
+                    return fmt::format("{}{}={}", d.is_undefine() ? 'U' : d.is_define() ? 'D' : 'V', d.get_name(),
+                                       d.get_value());
+                });
+            }
+            dedup(result.link_location, true, as_key);
+            dedup(result.link_libraries, true, as_key);
+            stats::counters.flags_after_dedup += count_flags(result);
+        }
+
         fs::path calculate_prefix(const fs::path & path) {
             // TODO: Windows
             // TODO: /cps/<name-like>
@@ -302,97 +849,205 @@ namespace cps::search {
             return p;
         }
 
-        /// @brief Calculate the required components in the graph
-        /// @param node The node to process
-        /// @param components the components required from this node
-        void set_components(std::shared_ptr<Node> node, const std::vector<std::string> & components,
-                            bool default_components) {
-            // Set the components that this package's depndees want
-            if (default_components && node->data.package.default_components) {
-                const std::vector<std::string> & defs = node->data.package.default_components.value();
-                node->data.components.insert(node->data.components.end(), defs.begin(), defs.end());
-            }
-            node->data.components.insert(node->data.components.end(), components.begin(), components.end());
-
-            for (const std::string & c_name : node->data.components) {
-                // It's possible that the Package::Requires section listed
-                // dependencies we don't actually need. If we don't need them we
-                // can trim the graph
-                std::vector<std::shared_ptr<Node>> trimmed;
-
-                // This *should* be validated such that we won't have an exception
-                const loader::Component & component = node->data.package.components.at(c_name);
-                auto && required = process_requires(component.require);
-                for (std::shared_ptr<Node> & child : node->depends) {
-                    if (auto && child_comps = required.find(child->data.package.name); child_comps != required.end()) {
-                        trimmed.emplace_back(child);
-                        set_components(child, child_comps->second.components, child_comps->second.defaults);
-                    }
-                }
-                node->depends = trimmed;
+        constexpr std::string_view prefix_token = "@prefix@";
 
-                if (auto && self = required.find(""); self != required.end()) {
-                    // Don't insert these twice
-                    if (!default_components && self->second.defaults && node->data.package.default_components) {
-                        const std::vector<std::string> & defs = node->data.package.default_components.value();
-                        node->data.components.insert(node->data.components.end(), defs.begin(), defs.end());
-                    }
-                    node->data.components.insert(node->data.components.end(), self->second.components.begin(),
-                                                 self->second.components.end());
-                }
+        /// @brief Whether a path starts with the @prefix@ placeholder
+        bool has_prefix(std::string_view s) {
+            return s.substr(0, prefix_token.size()) == prefix_token &&
+                   (s.size() == prefix_token.size() || s[prefix_token.size()] == '/');
+        }
+
+        /// @brief Replace the @prefix@ at the start of a path
+        /// @param s A path for which has_prefix() is true
+        /// @param prefix The prefix of the package, calculated once for all of its paths
+        std::string replace_prefix(std::string_view s, std::string_view prefix) {
+            std::string_view rest = s.substr(prefix_token.size());
+            // Don't double the slash when the prefix is /
+            if (!prefix.empty() && prefix.back() == '/' && !rest.empty()) {
+                rest.remove_prefix(1);
             }
+            std::string out;
+            out.reserve(prefix.size() + rest.size());
+            out.append(prefix).append(rest);
+            return out;
         }
 
     } // namespace
 
     Result::Result(){};
 
-    tl::expected<Result, std::string> find_package(std::string_view name) { return find_package(name, {}, true); }
+    std::vector<fs::path> Options::directories() const {
+        std::vector<fs::path> dirs;
+        dirs.reserve(prefixes.size() * 2);
+        for (auto && prefix : prefixes) {
+            dirs.emplace_back(prefix / libdir() / "cps");
+            dirs.emplace_back(prefix / "share" / "cps");
+        }
+        return dirs;
+    }
+
+    Options environment(const utils::Getenv & getenv) {
+        Options options{nix, index::default_path(getenv)};
+        if (const char * env = getenv("CPS_PATH")) {
+            auto && paths = utils::split(env);
+            options.prefixes.insert(options.prefixes.end(), paths.begin(), paths.end());
+        }
+        return options;
+    }
+
+    Context::Context(const Options & options) : dirs{options.directories()} {
+        trace::Span span{"context"};
+        if (options.index) {
+            // A missing or unreadable index is the same as an empty one
+            idx = index::read(options.index.value()).value_or(index::Index{});
+        }
+
+        listings.reserve(dirs.size());
+        for (auto && dir : dirs) {
+            // An up to date index knows everything in the directory, so
+            // there is no need to touch the filesystem
+            if (idx.covers(dir)) {
+                listings.emplace_back(std::nullopt);
+                continue;
+            }
+
+            // TODO: <prefix>/<libdir>/cps/<name-like>/
+            // TODO: <prefix>/share/cps/<name-like>/
+            // A directory which doesn't exist or can't be read has no CPS files
+            ++stats::counters.dirs_probed;
+            std::unordered_map<std::string, fs::path> & listing = listings.emplace_back().emplace();
+            std::error_code ec;
+            for (auto && entry : fs::directory_iterator{dir, ec}) {
+                // The type normally comes from the directory entry, and only
+                // needs a stat for symlinks and on filesystems that don't
+                // provide it
+                if (entry.path().extension() == ".cps" && entry.is_regular_file(ec)) {
+                    listing.emplace(entry.path().stem().string(), entry.path());
+                }
+            }
+        }
+    }
 
-    tl::expected<Result, std::string> find_package(std::string_view name, const std::vector<std::string> & components,
+    std::vector<fs::path> Context::find(std::string_view name) const {
+        const std::string key{name};
+        std::vector<fs::path> found;
+        for (size_t i = 0; i < dirs.size(); ++i) {
+            if (auto && listing = listings[i]) {
+                if (auto && hit = listing->find(key); hit != listing->end()) {
+                    found.emplace_back(hit->second);
+                }
+            } else if (auto && e = idx.find(dirs[i], name)) {
+                found.emplace_back(std::move(e->path));
+            }
+        }
+        return found;
+    }
+
+    std::optional<index::Entry> Context::indexed(const fs::path & path) const {
+        return idx.find(path.parent_path(), path.stem().string());
+    }
+
+    tl::expected<void, std::string> build_index(const Options & options, const fs::path & file) {
+        trace::Span span{"build_index"};
+        return index::write(CPS_TRY(index::build(options.directories())), file);
+    }
+
+    tl::expected<size_t, std::string> compile_all(const Options & options) {
+        trace::Span span{"compile_all"};
+        size_t compiled = 0;
+        std::vector<std::string> errors;
+        for (auto && dir : options.directories()) {
+            std::error_code ec;
+            for (auto && entry : fs::directory_iterator{dir, ec}) {
+                if (entry.path().extension() != ".cps" || !entry.is_regular_file(ec)) {
+                    continue;
+                }
+                if (auto && r = loader::compile(entry.path()); r) {
+                    ++compiled;
+                } else {
+                    errors.emplace_back(std::move(r.error()));
+                }
+            }
+        }
+        if (!errors.empty()) {
+            return tl::unexpected(fmt::format("{}", fmt::join(errors, "\n")));
+        }
+        return compiled;
+    }
+
+    tl::expected<Result, std::string> find_package(const Context & context, std::string_view name) {
+        return find_package(context, name, {}, true);
+    }
+
+    tl::expected<Result, std::string> find_package(const Context & context, std::string_view name,
+                                                   const std::vector<std::string> & components,
                                                    bool default_components) {
-        // XXX: do we need process_requires here?
-        auto && root = CPS_TRY(build_node(name, loader::Requirement{components}));
-        // This has to be done as a two step pass, since we want to trim any
-        // unecessary nodes from the graph, but we cannot do that while finding,
-        // since we could hae a diamond dependency, where the two dependees have
-        // different components they want.
-        set_components(root, components, default_components);
-        auto && flat = tsort(root);
+        return find_package(context, name, components, default_components,
+                            [](const fs::path & path) { return loader::load(path); });
+    }
+
+    tl::expected<Result, std::string> find_package(const Context & context, std::string_view name,
+                                                   const std::vector<std::string> & components,
+                                                   bool default_components, const Loader & load) {
+        return find_packages(context, {std::string{name}}, components, default_components, load);
+    }
+
+    tl::expected<Result, std::string> find_packages(const Context & context, const std::vector<std::string> & names,
+                                                    const std::vector<std::string> & components,
+                                                    bool default_components, const Loader & load) {
+        if (names.empty()) {
+            return tl::unexpected("Expected at least one package name");
+        }
 
+        // Every root shares one graph, so a dependency common to several of
+        // them is loaded once and appears once in the output
+        Graph graph{};
+        Resolver resolver{context, load, graph};
+        const loader::Requirement wanted{components};
+        std::vector<std::pair<std::string_view, const loader::Requirement *>> prefetched;
+        for (auto && name : names) {
+            prefetched.emplace_back(name, &wanted);
+        }
+        resolver.prefetch(prefetched);
+
+        const std::vector<NodeId> roots = CPS_TRY(resolver.roots(names, components, default_components));
+        const std::vector<NodeId> flat = CPS_TRY(tsort(graph, roots));
+
+        trace::Span merge{"merge"};
         Result result{};
 
-        result.version = root->data.package.version.value_or("unknown");
+        result.version = graph[roots.front()].data.package.version.value_or("unknown");
 
-        for (auto && node : flat) {
+        for (const NodeId id : flat) {
+            Node & node = graph[id];
 
+            // The prefix is only calculated if the package uses it, and then
+            // only once rather than for every path
+            std::optional<std::string> prefix;
             const auto && prefix_replacer = [&](const std::string & s) -> std::string {
                 // TODO: Windows…
-                auto && split = utils::split(s, "/");
-                if (split[0] == "@prefix@") {
-                    fs::path p = calculate_prefix(node->data.package.cps_path);
-                    for (auto it = split.begin() + 1; it != split.end(); ++it) {
-                        p /= *it;
-                    }
-                    return p;
+                if (!has_prefix(s)) {
+                    return s;
+                }
+                if (!prefix) {
+                    prefix = calculate_prefix(node.data.package.cps_path).string();
                 }
-                return s;
+                return replace_prefix(s, prefix.value());
             };
 
-            for (const auto & c_name : node->data.components) {
+            for (const auto & c_name : node.data.components) {
                 // We should have already errored if this is not the case
-                auto && f = node->data.package.components.find(c_name);
-                utils::assert_fn(
-                    f != node->data.package.components.end(),
-                    fmt::format("Could not find component {} of pacakge {}", c_name, node->data.package.name));
-                auto && comp = f->second;
+                auto && f = node.data.package.get_component(c_name);
+                utils::assert_fn(f.has_value(), fmt::format("Could not find component {} of pacakge {}", c_name,
+                                                            node.data.package.name));
+                const loader::Component & comp = *f.value();
 
                 // Convert prefix at this point because:
                 // 1. we are about to lose which CPS file the information came
                 // from
                 // 2. if we do it at the search point we have to plumb overrides
                 // deep into that
-                merge_result<loader::KnownLanguages, std::string>(comp.includes, result.includes, prefix_replacer);
+                merge_result(comp.includes, result.includes, prefix_replacer);
                 merge_result(comp.defines, result.defines);
                 merge_result(comp.compile_flags, result.compile_flags);
                 merge_result(comp.link_libraries, result.link_libraries);
@@ -403,6 +1058,8 @@ namespace cps::search {
             }
         }
 
+        dedup_flags(result);
+
         return result;
     }
 
@@ -3,11 +3,19 @@
 
 #pragma once
 
+#include "cps/index.hpp"
 #include "cps/loader.hpp"
+#include "cps/utils.hpp"
 
 #include <tl/expected.hpp>
 
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace cps::search {
@@ -24,12 +32,94 @@ namespace cps::search {
         std::vector<std::string> link_location;
     };
 
+    /// @brief Function used to read a CPS file from disk
+    ///
+    /// Packages which will be needed together are loaded at the same time, so
+    /// this may be called from several threads at once. It is never called
+    /// twice for the same file in one query.
+    using Loader = std::function<tl::expected<loader::Package, std::string>(const std::filesystem::path &)>;
+
+    /// @brief Where to search for packages
+    struct Options {
+        /// @brief The prefixes to search, in order
+        std::vector<std::filesystem::path> prefixes;
+        /// @brief An index of the CPS files under those prefixes, if there is one
+        std::optional<std::filesystem::path> index;
+
+        /// @brief The directories searched for CPS files, in order
+        std::vector<std::filesystem::path> directories() const;
+    };
+
+    /// @brief The options cps-config uses
+    ///
+    /// The system prefixes are searched, followed by any in $CPS_PATH, and the
+    /// index is index::default_path().
+    ///
+    /// @param getenv Where the variables are read from
+    Options environment(const utils::Getenv & getenv = std::getenv);
+
+    /// @brief The packages a query can find
+    ///
+    /// Everything is read when the context is created: the index, and each
+    /// search directory it doesn't cover. After that a context only answers
+    /// questions from memory and never changes, so it can be shared by any
+    /// number of queries, on any number of threads. Packages installed or
+    /// removed later are seen by the next context created.
+    class Context {
+      public:
+        explicit Context(const Options & options);
+
+        /// @brief The directories searched for CPS files, in order
+        const std::vector<std::filesystem::path> & directories() const { return dirs; }
+
+        /// @brief Every CPS file for a package, in search order
+        /// @return The files, which are empty if the package isn't installed
+        std::vector<std::filesystem::path> find(std::string_view name) const;
+
+        /// @brief What the index records about a CPS file
+        /// @return The entry, or nothing if the file's directory isn't indexed
+        std::optional<index::Entry> indexed(const std::filesystem::path & path) const;
+
+      private:
+        std::vector<std::filesystem::path> dirs;
+        index::Index idx;
+        /// @brief For each directory the index doesn't cover, package name to CPS file
+        std::vector<std::optional<std::unordered_map<std::string, std::filesystem::path>>> listings;
+    };
+
     // TODO: restrictions like versions
-    // TODO: caching loading packages?
     // TODO: multiple versions of packages?
-    tl::expected<Result, std::string> find_package(std::string_view name);
+    tl::expected<Result, std::string> find_package(const Context & context, std::string_view name);
 
-    tl::expected<Result, std::string> find_package(std::string_view name, const std::vector<std::string> & components,
+    tl::expected<Result, std::string> find_package(const Context & context, std::string_view name,
+                                                   const std::vector<std::string> & components,
                                                    bool default_components);
 
+    /// @brief Scan every search directory and write an index of the CPS files found
+    /// @param file The index file to write
+    tl::expected<void, std::string> build_index(const Options & options, const std::filesystem::path & file);
+
+    /// @brief Compile every CPS file in the search directories, see loader::compile
+    ///
+    /// Adding the compiled files changes the search directories, which makes
+    /// an index built before this stale, so build the index afterwards.
+    ///
+    /// @return The number of files compiled, or every error hit along the way
+    tl::expected<size_t, std::string> compile_all(const Options & options);
+
+    /// @brief Find a package, reading CPS files with the given loader
+    /// @param load Called at most once for each CPS file in a query
+    tl::expected<Result, std::string> find_package(const Context & context, std::string_view name,
+                                                   const std::vector<std::string> & components,
+                                                   bool default_components, const Loader & load);
+
+    /// @brief Find several packages, and merge them into one result
+    /// @param names The packages to find, in the order their flags should appear
+    /// @param components The components to use from each package
+    /// @param load Called at most once for each CPS file in a query
+    /// @return A result where the version is that of the first package
+    tl::expected<Result, std::string> find_packages(const Context & context, const std::vector<std::string> & names,
+                                                    const std::vector<std::string> & components,
+                                                    bool default_components, const Loader & load);
+
 } // namespace cps::search
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "cps/stats.hpp"
+
+#include <fmt/format.h>
+
+#include <iterator>
+
+namespace cps::stats {
+
+    Counters counters{};
+
+    void reset() { counters = Counters{}; }
+
+    std::string format(const Counters & c) {
+        std::string out;
+        const auto && line = [&out](std::string_view name, uint64_t value) {
+            fmt::format_to(std::back_inserter(out), "{:<24}{}\n", name, value);
+        };
+        line("directories probed", c.dirs_probed);
+        line("files stat'd", c.files_stated);
+        line("CPS files parsed", c.files_parsed);
+        line("compiled files loaded", c.files_compiled);
+        line("bytes read", c.bytes_read);
+        line("node cache hits", c.node_cache_hits);
+        line("node cache misses", c.node_cache_misses);
+        line("package cache hits", c.package_cache_hits);
+        line("package cache misses", c.package_cache_misses);
+        line("version comparisons", c.version_comparisons);
+        line("flags before dedup", c.flags_before_dedup);
+        line("flags after dedup", c.flags_after_dedup);
+        return out;
+    }
+
+} // namespace cps::stats
@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace cps::stats {
+
+    /// @brief A count which may be incremented by several threads at once
+    ///
+    /// Increments are relaxed, so a count is only exact once the threads
+    /// making them have been joined.
+    class Counter {
+      public:
+        Counter(uint64_t v = 0) : value{v} {};
+        Counter(const Counter & o) : value{o} {};
+        Counter & operator=(const Counter & o) {
+            value.store(o, std::memory_order_relaxed);
+            return *this;
+        }
+
+        Counter & operator++() {
+            value.fetch_add(1, std::memory_order_relaxed);
+            return *this;
+        }
+        Counter & operator+=(uint64_t n) {
+            value.fetch_add(n, std::memory_order_relaxed);
+            return *this;
+        }
+        operator uint64_t() const { return value.load(std::memory_order_relaxed); }
+
+      private:
+        std::atomic<uint64_t> value;
+    };
+
+    /// @brief How much work the search has done
+    ///
+    /// These are always counted, as an increment costs less than checking
+    /// whether anyone is interested.
+    struct Counters {
+        /// @brief Search directories read from the filesystem, rather than found in the index
+        Counter dirs_probed;
+        /// @brief Files and directories stat'd by path
+        ///
+        /// Type checks on the entries of a directory being read are not
+        /// counted, as the listing usually answers them without a stat().
+        Counter files_stated;
+        /// @brief CPS files parsed
+        Counter files_parsed;
+        /// @brief CPS files decoded from their compiled form, rather than parsed as JSON
+        Counter files_compiled;
+        /// @brief Bytes of CPS files loaded, compiled or not
+        Counter bytes_read;
+        /// @brief Dependencies which had already been resolved in this query
+        Counter node_cache_hits;
+        Counter node_cache_misses;
+        /// @brief CPS files which had already been loaded by an earlier query,
+        ///        for callers that keep them between queries
+        Counter package_cache_hits;
+        Counter package_cache_misses;
+        Counter version_comparisons;
+        /// @brief Flags in the result, before and after repeated flags are removed
+        Counter flags_before_dedup;
+        Counter flags_after_dedup;
+    };
+
+    /// @brief The counters of this process
+    extern Counters counters;
+
+    /// @brief Set every counter to zero
+    void reset();
+
+    /// @brief One counter per line, for showing to a human
+    std::string format(const Counters & c);
+
+} // namespace cps::stats
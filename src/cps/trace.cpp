@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#include "cps/trace.hpp"
+
+#include <fmt/core.h>
+#include <json/json.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace cps::trace {
+
+    namespace {
+
+        using Clock = std::chrono::steady_clock;
+
+        struct Event {
+            const char * name;
+            /// @brief The thread the span was on, numbered from 1 in the order threads first record one
+            uint64_t thread;
+            Clock::time_point start;
+            Clock::duration duration{};
+            std::vector<std::pair<const char *, std::variant<std::string, uint64_t>>> args{};
+        };
+
+        Clock::time_point epoch{};
+        /// @brief Guards events, since CPS files may be loaded on several threads
+        std::mutex events_lock{};
+        std::vector<Event> events{};
+
+        uint64_t this_thread() {
+            static std::atomic<uint64_t> threads{0};
+            thread_local const uint64_t id = threads.fetch_add(1, std::memory_order_relaxed) + 1;
+            return id;
+        }
+
+    } // namespace
+
+    namespace detail {
+
+        bool recording = false;
+
+        // Events are referred to by index rather than by reference, as
+        // another thread may grow the vector at any time
+
+        size_t begin(const char * name) {
+            const uint64_t thread = this_thread();
+            const std::lock_guard<std::mutex> guard{events_lock};
+            events.push_back(Event{name, thread, Clock::now()});
+            return events.size() - 1;
+        }
+
+        void end(size_t event) {
+            const Clock::time_point now = Clock::now();
+            const std::lock_guard<std::mutex> guard{events_lock};
+            Event & e = events[event];
+            e.duration = now - e.start;
+        }
+
+        void arg(size_t event, const char * key, std::string_view value) {
+            const std::lock_guard<std::mutex> guard{events_lock};
+            events[event].args.emplace_back(key, std::string{value});
+        }
+
+        void arg(size_t event, const char * key, uint64_t value) {
+            const std::lock_guard<std::mutex> guard{events_lock};
+            events[event].args.emplace_back(key, value);
+        }
+
+    } // namespace detail
+
+    void start() {
+        events.clear();
+        epoch = Clock::now();
+        detail::recording = true;
+    }
+
+    tl::expected<void, std::string> stop(const fs::path & file) {
+        detail::recording = false;
+
+        const auto && micros = [](Clock::duration d) {
+            return std::chrono::duration<double, std::micro>{d}.count();
+        };
+
+        // Events are complete ("X") events, which the viewers nest by time
+        Json::Value list{Json::arrayValue};
+        for (auto && e : events) {
+            Json::Value value{Json::objectValue};
+            value["name"] = e.name;
+            value["ph"] = "X";
+            value["ts"] = micros(e.start - epoch);
+            value["dur"] = micros(e.duration);
+            value["pid"] = 1;
+            value["tid"] = Json::UInt64{e.thread};
+            if (!e.args.empty()) {
+                Json::Value & args = value["args"] = Json::Value{Json::objectValue};
+                for (auto && [key, v] : e.args) {
+                    if (auto && s = std::get_if<std::string>(&v)) {
+                        args[key] = *s;
+                    } else {
+                        args[key] = Json::UInt64{std::get<uint64_t>(v)};
+                    }
+                }
+            }
+            list.append(std::move(value));
+        }
+        events.clear();
+
+        Json::Value root{Json::objectValue};
+        root["traceEvents"] = std::move(list);
+        root["displayTimeUnit"] = "ns";
+
+        std::ofstream out{file};
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        std::unique_ptr<Json::StreamWriter> writer{builder.newStreamWriter()};
+        writer->write(root, &out);
+        out << '\n';
+        if (!out) {
+            return tl::unexpected(fmt::format("Could not write trace file {}", file.string()));
+        }
+        return {};
+    }
+
+} // namespace cps::trace
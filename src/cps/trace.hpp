@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2024 Dylan Baker
+
+#pragma once
+
+#include <tl/expected.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+namespace cps::trace {
+
+    namespace detail {
+
+        /// @brief Whether spans are being recorded
+        ///
+        /// This is read inline, so that a Span costs a single branch when
+        /// tracing is disabled. It is only changed while no query is running,
+        /// so spans may be recorded from any thread.
+        extern bool recording;
+
+        size_t begin(const char * name);
+        void end(size_t event);
+        void arg(size_t event, const char * key, std::string_view value);
+        void arg(size_t event, const char * key, uint64_t value);
+
+    } // namespace detail
+
+    /// @brief Start recording spans, discarding any recorded before
+    void start();
+
+    /// @brief Stop recording, and write the spans recorded to a file
+    ///
+    /// The file is in the Chrome trace event format, which can be opened with
+    /// chrome://tracing or https://ui.perfetto.dev.
+    tl::expected<void, std::string> stop(const std::filesystem::path & file);
+
+    /// @brief Whether spans are being recorded
+    inline bool enabled() { return detail::recording; }
+
+    /// @brief Records the time spent in the enclosing scope
+    ///
+    /// Does nothing unless tracing was enabled when it was created.
+    class Span {
+      public:
+        /// @param name Must outlive the trace, normally a string literal
+        explicit Span(const char * name) : event{detail::recording ? detail::begin(name) : none} {}
+        ~Span() {
+            if (event != none) {
+                detail::end(event);
+            }
+        }
+        Span(const Span &) = delete;
+        Span & operator=(const Span &) = delete;
+
+        /// @brief Attach a value, which is shown when the span is selected
+        /// @param key Must outlive the trace, normally a string literal
+        void arg(const char * key, std::string_view value) {
+            if (event != none) {
+                detail::arg(event, key, value);
+            }
+        }
+        void arg(const char * key, uint64_t value) {
+            if (event != none) {
+                detail::arg(event, key, value);
+            }
+        }
+
+      private:
+        static constexpr size_t none = SIZE_MAX;
+        const size_t event;
+    };
+
+} // namespace cps::trace
@@ -8,6 +8,7 @@
 
 #include <fmt/core.h>
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -38,4 +39,8 @@ namespace cps::utils {
 
     std::vector<std::string> split(std::string_view input, std::string_view delim = ":");
 
+    /// @brief Look up an environment variable, like std::getenv
+    /// @return The value, or nullptr if it isn't set
+    using Getenv = std::function<const char *(const char * name)>;
+
 } // namespace cps::utils
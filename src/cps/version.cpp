@@ -10,105 +10,349 @@
 #include <fmt/core.h>
 
 #include <algorithm>
+#include <charconv>
 #include <cstdint>
-#include <functional>
+#include <system_error>
 
 namespace cps::version {
 
     namespace {
 
-        tl::expected<std::vector<uint64_t>, std::string> as_numbers(std::string_view v) {
-            std::vector<std::string> split = utils::split(v, ".");
-            std::vector<uint64_t> left;
-            left.reserve(split.size());
-            for (auto && n : split) {
-                try {
-                    left.emplace_back(std::stoull(n));
-                } catch (std::invalid_argument &) {
-                    return tl::unexpected{fmt::format("'{}' is not a valid number", n)};
-                } catch (std::out_of_range &) {
-                    return tl::unexpected{fmt::format("'{}' is too large to be represented by a uint64. What "
-                                                      "kind of versions are you creating?",
-                                                      n)};
-                }
+        bool matches(int cmp, Operator op) {
+            switch (op) {
+            case Operator::eq:
+                return cmp == 0;
+            case Operator::ne:
+                return cmp != 0;
+            case Operator::lt:
+                return cmp < 0;
+            case Operator::le:
+                return cmp <= 0;
+            case Operator::gt:
+                return cmp > 0;
+            case Operator::ge:
+                return cmp >= 0;
             }
-            return left;
+            CPS_UNREACHABLE("Unknown version operator");
+            return false;
         }
 
-        inline void lengthen(std::vector<uint64_t> & target, uint64_t diff) {
-            target.reserve(diff);
-            for (uint64_t i = 0; i < diff; ++i) {
-                target.emplace_back(0);
+        // The <cctype> functions depend on the locale, versions do not
+
+        bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+        bool is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+        int sign(int v) { return (v > 0) - (v < 0); }
+
+        /// @brief The character at i, or '\0' past the end, like a C string
+        char at(std::string_view s, size_t i) { return i < s.size() ? s[i] : '\0'; }
+
+        /// @brief The sort weight of a non-digit character in a dpkg version
+        int dpkg_order(char c) {
+            if (is_digit(c)) {
+                return 0;
+            }
+            if (is_alpha(c)) {
+                return c;
             }
+            if (c == '~') {
+                return -1;
+            }
+            if (c != '\0') {
+                return c + 256;
+            }
+            return 0;
         }
 
-        inline void equalize_length(std::vector<uint64_t> & left, std::vector<uint64_t> & right) {
-            if (left.size() < right.size()) {
-                lengthen(left, right.size() - left.size());
-            } else if (left.size() > right.size()) {
-                lengthen(right, left.size() - right.size());
+        /// @brief dpkg's verrevcmp, used for both the upstream version and revision
+        int dpkg_verrevcmp(std::string_view a, std::string_view b) {
+            size_t i = 0;
+            size_t j = 0;
+            while (i < a.size() || j < b.size()) {
+                // Everything up to the next digit is compared by dpkg_order,
+                // which puts ~ before the end of the string, and letters
+                // before anything else
+                while ((i < a.size() && !is_digit(a[i])) || (j < b.size() && !is_digit(b[j]))) {
+                    const int ac = dpkg_order(at(a, i));
+                    const int bc = dpkg_order(at(b, j));
+                    if (ac != bc) {
+                        return sign(ac - bc);
+                    }
+                    ++i;
+                    ++j;
+                }
+
+                // Then the digits are compared as a number
+                while (at(a, i) == '0') {
+                    ++i;
+                }
+                while (at(b, j) == '0') {
+                    ++j;
+                }
+                int first_diff = 0;
+                while (is_digit(at(a, i)) && is_digit(at(b, j))) {
+                    if (first_diff == 0) {
+                        first_diff = a[i] - b[j];
+                    }
+                    ++i;
+                    ++j;
+                }
+                if (is_digit(at(a, i))) {
+                    return 1;
+                }
+                if (is_digit(at(b, j))) {
+                    return -1;
+                }
+                if (first_diff != 0) {
+                    return sign(first_diff);
+                }
             }
+            return 0;
         }
 
+        struct DpkgVersion {
+            uint64_t epoch = 0;
+            std::string_view upstream;
+            std::string_view revision;
+        };
+
+        tl::expected<DpkgVersion, std::string> dpkg_split(std::string_view v) {
+            DpkgVersion out{};
+            if (const size_t colon = v.find(':'); colon != std::string_view::npos) {
+                const std::string_view epoch = v.substr(0, colon);
+                auto && [ptr, ec] = std::from_chars(epoch.data(), epoch.data() + epoch.size(), out.epoch);
+                if (ec != std::errc{} || ptr != epoch.data() + epoch.size()) {
+                    return tl::unexpected{fmt::format("'{}' is not a valid epoch", epoch)};
+                }
+                v.remove_prefix(colon + 1);
+            }
+            // The revision is everything after the last hyphen, so the
+            // upstream version may contain hyphens too
+            if (const size_t dash = v.rfind('-'); dash != std::string_view::npos) {
+                out.revision = v.substr(dash + 1);
+                v = v.substr(0, dash);
+            }
+            out.upstream = v;
+            return out;
+        }
+
+        /// @brief Reads the dot separated parts of a simple version one at a time
+        class Parts {
+          public:
+            Parts(std::string_view v) : rest{v} {};
+
+            /// @brief Whether every part has been read
+            bool done() const { return finished; }
+
+            tl::expected<uint64_t, std::string> next() {
+                const size_t end = std::min(rest.find('.'), rest.size());
+                const std::string_view part = rest.substr(0, end);
+
+                // Like std::stoull, anything after the leading digits is ignored
+                uint64_t n = 0;
+                auto && [_, ec] = std::from_chars(part.data(), part.data() + part.size(), n);
+                if (ec == std::errc::invalid_argument) {
+                    return tl::unexpected{fmt::format("'{}' is not a valid number", part)};
+                }
+                if (ec == std::errc::result_out_of_range) {
+                    return tl::unexpected{fmt::format("'{}' is too large to be represented by a uint64. What "
+                                                      "kind of versions are you creating?",
+                                                      part)};
+                }
+
+                if (end == rest.size()) {
+                    finished = true;
+                } else {
+                    rest.remove_prefix(end + 1);
+                }
+                return n;
+            }
+
+          private:
+            std::string_view rest;
+            bool finished = false;
+        };
+
         tl::expected<bool, std::string> simple_compare(std::string_view l, Operator op, std::string_view r) {
             // TODO: handle the -.* or +.* ending
-            // TODO: 32 bit probably needs stoull…
-            std::vector<uint64_t> left = CPS_TRY(as_numbers(l));
-            std::vector<uint64_t> right = CPS_TRY(as_numbers(r));
-            equalize_length(left, right);
-
-            // TODO: this is so ugly
-            for (size_t i = 0; i < left.size(); ++i) {
-                const uint64_t lv = left[i];
-                const uint64_t rv = right[i];
-
-                switch (op) {
-                case Operator::eq:
-                    if (lv != rv) {
-                        return false;
-                    }
-                    break;
-                case Operator::le:
-                    if (lv > rv) {
-                        return false;
-                    }
-                    break;
-                case Operator::ge:
-                    if (lv < rv) {
-                        return false;
-                    }
-                    break;
-                case Operator::lt:
-                    if (lv < rv) {
-                        return true;
-                    }
-                    break;
-                case Operator::gt:
-                    if (lv > rv) {
-                        return true;
-                    }
-                    break;
-                case Operator::ne:
-                    if (lv != rv) {
-                        return true;
-                    }
-                    break;
+            // The parts are compared as they are read rather than parsed into
+            // a Version, so that there can be any number of them. Both are
+            // still read to the end, so that an invalid part is an error
+            // wherever it is.
+            Parts left{l};
+            Parts right{r};
+            int cmp = 0;
+            while (!left.done() || !right.done()) {
+                const uint64_t lv = left.done() ? 0 : CPS_TRY(left.next());
+                const uint64_t rv = right.done() ? 0 : CPS_TRY(right.next());
+                if (cmp == 0) {
+                    cmp = (lv > rv) - (lv < rv);
                 }
             }
-
-            return (op == Operator::eq || op == Operator::le || op == Operator::ge);
+            return matches(cmp, op);
         }
 
     } // namespace
 
+    tl::expected<Version, std::string> Version::parse(std::string_view str) {
+        Version v{};
+        Parts parts{str};
+        while (!parts.done()) {
+            const uint64_t n = CPS_TRY(parts.next());
+            // Zeros past the end are dropped below anyway, so they only
+            // matter if something non-zero follows them
+            if (v.count < max_parts) {
+                v.parts[v.count++] = n;
+            } else if (n != 0) {
+                return tl::unexpected{fmt::format("'{}' has more than {} parts", str, max_parts)};
+            }
+        }
+
+        // 1.0 and 1 are the same version, so trailing zeros are dropped
+        while (v.count > 0 && v.parts[v.count - 1] == 0) {
+            --v.count;
+        }
+        return v;
+    }
+
+    size_t Version::size() const { return count; }
+
+    uint64_t Version::part(size_t i) const { return i < count ? parts[i] : 0; }
+
+    bool compare(const Version & left, Operator op, const Version & right) {
+        int cmp = 0;
+        const size_t size = std::max(left.size(), right.size());
+        for (size_t i = 0; i < size && cmp == 0; ++i) {
+            const uint64_t lv = left.part(i);
+            const uint64_t rv = right.part(i);
+            cmp = (lv > rv) - (lv < rv);
+        }
+
+        return matches(cmp, op);
+    }
+
+    int rpm_compare(std::string_view a, std::string_view b) {
+        if (a == b) {
+            return 0;
+        }
+
+        size_t i = 0;
+        size_t j = 0;
+        while (i < a.size() || j < b.size()) {
+            // Anything other than letters, numbers, ~ and ^ only separates segments
+            while (i < a.size() && !is_digit(a[i]) && !is_alpha(a[i]) && a[i] != '~' && a[i] != '^') {
+                ++i;
+            }
+            while (j < b.size() && !is_digit(b[j]) && !is_alpha(b[j]) && b[j] != '~' && b[j] != '^') {
+                ++j;
+            }
+
+            // ~ sorts before everything, even the end of the version
+            if (at(a, i) == '~' || at(b, j) == '~') {
+                if (at(a, i) != '~') {
+                    return 1;
+                }
+                if (at(b, j) != '~') {
+                    return -1;
+                }
+                ++i;
+                ++j;
+                continue;
+            }
+
+            // ^ sorts after the end of the version, but before anything else
+            if (at(a, i) == '^' || at(b, j) == '^') {
+                if (i == a.size()) {
+                    return -1;
+                }
+                if (j == b.size()) {
+                    return 1;
+                }
+                if (a[i] != '^') {
+                    return 1;
+                }
+                if (b[j] != '^') {
+                    return -1;
+                }
+                ++i;
+                ++j;
+                continue;
+            }
+
+            if (i == a.size() || j == b.size()) {
+                break;
+            }
+
+            // Take the next run of digits, or of letters, from each
+            const bool numeric = is_digit(a[i]);
+            const auto && in_segment = [numeric](char c) { return numeric ? is_digit(c) : is_alpha(c); };
+            size_t i_end = i;
+            while (i_end < a.size() && in_segment(a[i_end])) {
+                ++i_end;
+            }
+            size_t j_end = j;
+            while (j_end < b.size() && in_segment(b[j_end])) {
+                ++j_end;
+            }
+
+            // A number is always newer than letters
+            if (j == j_end) {
+                return numeric ? 1 : -1;
+            }
+
+            std::string_view one = a.substr(i, i_end - i);
+            std::string_view two = b.substr(j, j_end - j);
+            if (numeric) {
+                // Compare numbers by length, then digit by digit, so that
+                // they can be any size
+                one.remove_prefix(std::min(one.find_first_not_of('0'), one.size()));
+                two.remove_prefix(std::min(two.find_first_not_of('0'), two.size()));
+                if (one.size() != two.size()) {
+                    return one.size() > two.size() ? 1 : -1;
+                }
+            }
+            if (const int rc = one.compare(two); rc != 0) {
+                return sign(rc);
+            }
+
+            i = i_end;
+            j = j_end;
+        }
+
+        // Every segment was the same, but the separators were not
+        if (i == a.size() && j == b.size()) {
+            return 0;
+        }
+        // Otherwise whichever has something left is newer
+        return i == a.size() ? -1 : 1;
+    }
+
+    tl::expected<int, std::string> dpkg_compare(std::string_view left, std::string_view right) {
+        const DpkgVersion l = CPS_TRY(dpkg_split(left));
+        const DpkgVersion r = CPS_TRY(dpkg_split(right));
+        if (l.epoch != r.epoch) {
+            return l.epoch > r.epoch ? 1 : -1;
+        }
+        if (const int rc = dpkg_verrevcmp(l.upstream, r.upstream); rc != 0) {
+            return rc;
+        }
+        return dpkg_verrevcmp(l.revision, r.revision);
+    }
+
     tl::expected<bool, std::string> compare(std::string_view left, Operator op, std::string_view right, Schema schema) {
         switch (schema) {
         case Schema::simple:
             return simple_compare(left, op, right);
-        default:
-            CPS_UNREACHABLE("Only the simple schema is implemented");
-            return "Only the simple schema is implemented.";
+        case Schema::rpm:
+            return matches(rpm_compare(left, right), op);
+        case Schema::dpkg:
+            return dpkg_compare(left, right).map([op](int cmp) { return matches(cmp, op); });
+        case Schema::custom:
+            return tl::unexpected("Versions with a custom schema cannot be compared");
         }
+        CPS_UNREACHABLE("Unknown version schema");
+        return tl::unexpected("Unknown version schema");
     }
 
 } // namespace cps::version
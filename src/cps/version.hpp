@@ -6,7 +6,11 @@
 
 #include <tl/expected.hpp>
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 
 namespace cps::version {
 
@@ -28,6 +32,44 @@ namespace cps::version {
         ge,
     };
 
+    /// @brief A version in the simple schema, parsed so that it can be compared without allocating
+    class Version {
+      public:
+        /// @brief The most dot separated parts a version may have, ignoring trailing zeros
+        static constexpr size_t max_parts = 8;
+
+        /// @brief Parse a version string
+        ///
+        /// A version with more than max_parts parts can't be parsed. It is
+        /// still valid, and compare() with the simple schema compares it
+        /// from the string instead.
+        ///
+        /// @param str A dot separated list of numbers
+        static tl::expected<Version, std::string> parse(std::string_view str);
+
+        /// @brief The number of parts, not counting trailing zeros
+        size_t size() const;
+
+        /// @brief Get one part of the version
+        /// @return The part, which is 0 past the end of the version
+        uint64_t part(size_t i) const;
+
+      private:
+        std::array<uint64_t, max_parts> parts{};
+        uint8_t count = 0;
+    };
+
+    /// @brief compare two parsed versions using the given operator
+    bool compare(const Version & left, Operator op, const Version & right);
+
+    /// @brief Order two versions the way rpm's rpmvercmp does
+    /// @return less than, equal to or greater than 0 as left is older than, the same as or newer than right
+    int rpm_compare(std::string_view left, std::string_view right);
+
+    /// @brief Order two [epoch:]upstream[-revision] versions the way dpkg does
+    /// @return less than, equal to or greater than 0 as left is older than, the same as or newer than right
+    tl::expected<int, std::string> dpkg_compare(std::string_view left, std::string_view right);
+
     /// @brief compare two version strings using the given operator and schema
     tl::expected<bool, std::string> compare(std::string_view left, Operator op, std::string_view right, Schema schema);
 } // namespace cps::version
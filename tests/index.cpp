@@ -0,0 +1,139 @@
+// Copyright © 2024 Dylan Baker
+// SPDX-License-Identifier: MIT
+
+#include "cps/index.hpp"
+
+#include "scratch.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace cps::index::test {
+    namespace {
+
+        /// @brief Tests with a couple of the test cases copied into a scratch directory
+        class IndexTest : public cps::test::ScratchTest {
+          protected:
+            void SetUp() override {
+                const char * env = std::getenv("CPS_PATH");
+                ASSERT_NE(env, nullptr) << "CPS_PATH must point at the test cases";
+                ScratchTest::SetUp();
+                fs::copy_file(fs::path{env} / "lib" / "cps" / "minimal.cps", cps_dir / "minimal.cps");
+                fs::copy_file(fs::path{env} / "lib" / "cps" / "diamond.cps", cps_dir / "diamond.cps");
+            }
+        };
+
+        TEST_F(IndexTest, round_trip) {
+            const fs::path file = prefix / "index";
+            ASSERT_TRUE(write(build({cps_dir, prefix / "does-not-exist"}).value(), file));
+
+            auto && idx = read(file);
+            ASSERT_TRUE(idx.has_value()) << idx.error();
+            ASSERT_FALSE(idx->covers(prefix / "does-not-exist"));
+            ASSERT_TRUE(idx->covers(cps_dir));
+            ASSERT_FALSE(idx->find(cps_dir, "does-not-exist").has_value());
+            // Names on either side of every entry
+            ASSERT_FALSE(idx->find(cps_dir, "a").has_value());
+            ASSERT_FALSE(idx->find(cps_dir, "n").has_value());
+            ASSERT_FALSE(idx->find(cps_dir, "z").has_value());
+
+            const std::optional<Entry> found = idx->find(cps_dir, "minimal");
+            ASSERT_TRUE(found.has_value());
+            const Entry & minimal = found.value();
+            ASSERT_EQ(minimal.path, (cps_dir / "minimal.cps").string());
+            ASSERT_TRUE(minimal.loaded);
+            ASSERT_EQ(minimal.version, "1.0.0");
+            std::vector<std::string> comps = minimal.components;
+            std::sort(comps.begin(), comps.end());
+            ASSERT_EQ(comps, (std::vector<std::string>{"sample0", "sample1"}));
+
+            const std::optional<Entry> diamond = idx->find(cps_dir, "diamond");
+            ASSERT_TRUE(diamond.has_value());
+            std::vector<std::string> req = diamond->require;
+            std::sort(req.begin(), req.end());
+            ASSERT_EQ(req, (std::vector<std::string>{"needs-components1", "needs-components2"}));
+        }
+
+        TEST_F(IndexTest, stale_directory_is_dropped) {
+            const fs::path file = prefix / "index";
+            ASSERT_TRUE(write(build({cps_dir}).value(), file));
+
+            fs::last_write_time(cps_dir, fs::last_write_time(cps_dir) + std::chrono::hours{1});
+
+            auto && idx = read(file);
+            ASSERT_TRUE(idx.has_value()) << idx.error();
+            ASSERT_FALSE(idx->covers(cps_dir));
+            ASSERT_FALSE(idx->find(cps_dir, "minimal").has_value());
+        }
+
+        TEST_F(IndexTest, edited_file_is_not_current) {
+            const Index idx = build({cps_dir}).value();
+            const std::optional<Entry> found = idx.find(cps_dir, "minimal");
+            ASSERT_TRUE(found.has_value());
+            const Entry & minimal = found.value();
+            ASSERT_TRUE(current(minimal));
+
+            // Editing a file in place doesn't change its directory
+            std::ofstream{cps_dir / "minimal.cps", std::ios::app} << "\n";
+            ASSERT_FALSE(current(minimal));
+        }
+
+        TEST_F(IndexTest, damaged_file) {
+            const fs::path file = prefix / "index";
+            ASSERT_TRUE(write(build({cps_dir}).value(), file));
+            fs::resize_file(file, fs::file_size(file) - 1);
+            ASSERT_FALSE(read(file).has_value());
+
+            std::ofstream{file} << R"({"format_version": 1})";
+            ASSERT_FALSE(read(file).has_value());
+        }
+
+        /// @brief Unsets some environment variables, and puts them back when destroyed
+        class UnsetEnv {
+          public:
+            UnsetEnv(std::initializer_list<const char *> names) {
+                for (const char * name : names) {
+                    const char * value = std::getenv(name);
+                    saved.emplace_back(name, value ? std::optional<std::string>{value} : std::nullopt);
+                    ::unsetenv(name);
+                }
+            }
+            ~UnsetEnv() {
+                for (auto && [name, value] : saved) {
+                    if (value) {
+                        ::setenv(name, value->c_str(), 1);
+                    } else {
+                        ::unsetenv(name);
+                    }
+                }
+            }
+            UnsetEnv(const UnsetEnv &) = delete;
+            UnsetEnv & operator=(const UnsetEnv &) = delete;
+
+          private:
+            std::vector<std::pair<const char *, std::optional<std::string>>> saved;
+        };
+
+        TEST(IndexPathTest, no_cache_directory) {
+            const UnsetEnv unset{"CPS_INDEX", "XDG_CACHE_HOME", "HOME"};
+            ASSERT_FALSE(default_path().has_value());
+            ::setenv("CPS_INDEX", "/somewhere/index", 1);
+            ASSERT_EQ(default_path(), fs::path{"/somewhere/index"});
+        }
+
+        TEST(IndexReadTest, missing_file) { ASSERT_FALSE(read("/does/not/exist/index").has_value()); }
+
+    } // unnamed namespace
+} // namespace cps::index::test
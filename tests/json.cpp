@@ -0,0 +1,73 @@
+// Copyright © 2024 Dylan Baker
+// SPDX-License-Identifier: MIT
+
+#include "cps/json.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace cps::json::test {
+    namespace {
+
+        TEST(ReaderTest, object) {
+            Reader reader{R"({"a": "b", "c": [1, true, null, {"d": -1.5e3}], "e": "f"})"};
+            ASSERT_EQ(reader.enter().value(), Type::object);
+
+            std::vector<std::string> keys;
+            std::string_view key;
+            while (reader.next_member(key).value()) {
+                keys.emplace_back(key);
+                if (key == "c") {
+                    ASSERT_EQ(reader.skip().value(), Type::array);
+                } else {
+                    ASSERT_EQ(reader.peek().value(), Type::string);
+                    reader.string().value();
+                }
+            }
+            ASSERT_EQ(keys, (std::vector<std::string>{"a", "c", "e"}));
+            ASSERT_TRUE(reader.at_end());
+        }
+
+        TEST(ReaderTest, escapes) {
+            Reader reader{R"(["plain", "a\"b\\c\/d\n", "\u00e9\ud83d\ude00"])"};
+            ASSERT_EQ(reader.enter().value(), Type::array);
+
+            std::vector<std::string> values;
+            while (reader.next_element().value()) {
+                values.emplace_back(reader.string().value());
+            }
+            ASSERT_EQ(values, (std::vector<std::string>{"plain", "a\"b\\c/d\n", "\xc3\xa9\xf0\x9f\x98\x80"}));
+        }
+
+        TEST(ReaderTest, errors) {
+            for (auto && doc : {R"({"a" "b"})", R"(["a",])", R"(["a" "b"])", R"("abc)", R"(["\x"])", "[tru]"}) {
+                Reader reader{doc};
+                ASSERT_FALSE(reader.skip().has_value()) << doc;
+            }
+        }
+
+        TEST(ReaderTest, deep_nesting) {
+            // Deep enough to overflow the stack if skip recursed
+            const size_t depth = 200000;
+            const std::string doc =
+                R"({"x-extra": )" + std::string(depth, '[') + std::string(depth, ']') + R"(, "a": 1})";
+            Reader reader{doc};
+            ASSERT_EQ(reader.enter().value(), Type::object);
+            std::string_view key;
+            ASSERT_TRUE(reader.next_member(key).value());
+            ASSERT_EQ(reader.skip().value(), Type::array);
+            ASSERT_TRUE(reader.next_member(key).value());
+            ASSERT_EQ(key, "a");
+            ASSERT_EQ(reader.skip().value(), Type::number);
+            ASSERT_FALSE(reader.next_member(key).value());
+            ASSERT_TRUE(reader.at_end());
+
+            // Unclosed, it is an error rather than a crash
+            Reader unclosed{std::string(depth, '[')};
+            ASSERT_FALSE(unclosed.skip().has_value());
+        }
+
+    } // unnamed namespace
+} // namespace cps::json::test
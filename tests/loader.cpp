@@ -0,0 +1,212 @@
+// Copyright © 2024 Dylan Baker
+// SPDX-License-Identifier: MIT
+
+#include "cps/binary.hpp"
+#include "cps/loader.hpp"
+#include "cps/stats.hpp"
+
+#include "scratch.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace cps::loader::test {
+    namespace {
+
+        std::vector<std::string> test_cases() {
+            std::vector<std::string> files;
+            if (const char * env = std::getenv("CPS_PATH")) {
+                for (auto && f : fs::directory_iterator{fs::path{env} / "lib" / "cps"}) {
+                    files.emplace_back(f.path().string());
+                }
+            }
+            std::sort(files.begin(), files.end());
+            return files;
+        }
+
+        void expect_same(const LangValues & l, const LangValues & r) {
+            ASSERT_EQ(l.size(), r.size());
+            for (auto && [lang, values] : l) {
+                ASSERT_EQ(values, r.at(lang));
+            }
+        }
+
+        void expect_same(const Defines & l, const Defines & r) {
+            ASSERT_EQ(l.size(), r.size());
+            for (auto && [lang, defines] : l) {
+                const std::vector<Define> & other = r.at(lang);
+                ASSERT_EQ(defines.size(), other.size());
+                for (size_t i = 0; i < defines.size(); ++i) {
+                    ASSERT_EQ(defines[i].get_name(), other[i].get_name());
+                    ASSERT_EQ(defines[i].get_value(), other[i].get_value());
+                    ASSERT_EQ(defines[i].is_define(), other[i].is_define());
+                    ASSERT_EQ(defines[i].is_undefine(), other[i].is_undefine());
+                }
+            }
+        }
+
+        /// @brief Check that two packages hold the same values
+        /// @param actual Components are parsed as they are compared
+        void expect_same(Package & actual, const Package & expected) {
+            ASSERT_EQ(actual.name, expected.name);
+            ASSERT_EQ(actual.cps_version, expected.cps_version);
+            ASSERT_EQ(actual.cps_path, expected.cps_path);
+            ASSERT_EQ(actual.default_components, expected.default_components);
+            ASSERT_EQ(actual.version, expected.version);
+            ASSERT_EQ(actual.compat_version, expected.compat_version);
+            ASSERT_EQ(actual.version_schema, expected.version_schema);
+            ASSERT_EQ(actual.parsed_version.has_value(), expected.parsed_version.has_value());
+
+            ASSERT_EQ(actual.require.size(), expected.require.size());
+            for (auto && [name, req] : expected.require) {
+                const Requirement & other = actual.require.at(name);
+                ASSERT_EQ(other.components, req.components) << name;
+                ASSERT_EQ(other.version, req.version) << name;
+            }
+
+            ASSERT_EQ(actual.components.size(), expected.components.size());
+            for (auto && [name, comp] : expected.components) {
+                SCOPED_TRACE(name);
+                auto && parsed = actual.get_component(name);
+                ASSERT_TRUE(parsed.has_value()) << parsed.error();
+                const Component & other = *parsed.value();
+                ASSERT_FALSE(other.raw.has_value());
+                ASSERT_EQ(other.type, comp.type);
+                expect_same(other.compile_flags, comp.compile_flags);
+                expect_same(other.includes, comp.includes);
+                expect_same(other.defines, comp.defines);
+                ASSERT_EQ(other.link_libraries, comp.link_libraries);
+                ASSERT_EQ(other.location, comp.location);
+                ASSERT_EQ(other.link_location, comp.link_location);
+                ASSERT_EQ(other.require, comp.require);
+            }
+        }
+
+        class BackendTest : public ::testing::TestWithParam<std::string> {};
+
+        TEST_P(BackendTest, same_package) {
+            auto && expected = load(GetParam(), Backend::jsoncpp);
+            ASSERT_TRUE(expected.has_value()) << expected.error();
+            auto && actual = load(GetParam(), Backend::streaming);
+            ASSERT_TRUE(actual.has_value()) << actual.error();
+            expect_same(actual.value(), expected.value());
+        }
+
+        TEST_P(BackendTest, binary_round_trip) {
+            auto && expected = load(GetParam(), Backend::jsoncpp);
+            ASSERT_TRUE(expected.has_value()) << expected.error();
+            // Encode a lazily loaded package, whose components stay unparsed on the way
+            auto && lazy = load(GetParam(), Backend::streaming);
+            ASSERT_TRUE(lazy.has_value()) << lazy.error();
+            auto && encoded = binary::encode(lazy.value());
+            ASSERT_TRUE(encoded.has_value()) << encoded.error();
+            auto && actual = binary::decode(encoded.value());
+            ASSERT_TRUE(actual.has_value()) << actual.error();
+            for (auto && [name, comp] : actual->components) {
+                ASSERT_TRUE(comp.raw.has_value()) << name;
+            }
+            expect_same(actual.value(), expected.value());
+        }
+
+        TEST(LoaderTest, lazy_components) {
+            const char * env = std::getenv("CPS_PATH");
+            ASSERT_NE(env, nullptr);
+            auto && p = load(fs::path{env} / "lib" / "cps" / "multiple-components.cps", Backend::streaming);
+            ASSERT_TRUE(p.has_value()) << p.error();
+
+            // Nothing is parsed until it is asked for
+            for (auto && [_, comp] : p->components) {
+                ASSERT_TRUE(comp.raw.has_value());
+            }
+
+            auto && sample3 = p->get_component("sample3");
+            ASSERT_TRUE(sample3.has_value()) << sample3.error();
+            ASSERT_EQ(sample3.value()->link_libraries, (std::vector<std::string>{"dl", "rt"}));
+            ASSERT_FALSE(p->components.at("sample3").raw.has_value());
+            ASSERT_TRUE(p->components.at("sample1").raw.has_value());
+
+            ASSERT_FALSE(p->get_component("does-not-exist").has_value());
+        }
+
+        TEST(LoaderTest, damaged_binary) {
+            const char * env = std::getenv("CPS_PATH");
+            ASSERT_NE(env, nullptr);
+            ASSERT_FALSE(binary::decode("").has_value());
+            ASSERT_FALSE(binary::decode("{\"name\": \"json\"}").has_value());
+
+            // Parsed and unparsed components are encoded differently
+            for (auto && backend : {Backend::jsoncpp, Backend::streaming}) {
+                auto && p = load(fs::path{env} / "lib" / "cps" / "multiple-components.cps", backend);
+                ASSERT_TRUE(p.has_value()) << p.error();
+                auto && encoded = binary::encode(p.value());
+                ASSERT_TRUE(encoded.has_value()) << encoded.error();
+
+                for (size_t size = 0; size < encoded->size(); ++size) {
+                    ASSERT_FALSE(binary::decode(std::string_view{encoded.value()}.substr(0, size)).has_value())
+                        << size;
+                }
+                ASSERT_FALSE(binary::decode(encoded.value() + "x").has_value());
+            }
+        }
+
+        TEST(LoaderTest, missing_file) {
+            for (auto && backend : {Backend::jsoncpp, Backend::streaming}) {
+                auto && p = load("/does/not/exist.cps", backend);
+                ASSERT_FALSE(p.has_value());
+                ASSERT_NE(p.error().find("/does/not/exist.cps"), std::string::npos) << p.error();
+            }
+        }
+
+        using cps::test::ScratchTest;
+
+        TEST_F(ScratchTest, compiled_files) {
+            const char * env = std::getenv("CPS_PATH");
+            ASSERT_NE(env, nullptr);
+            const fs::path path = cps_dir / "multiple-components.cps";
+            fs::copy_file(fs::path{env} / "lib" / "cps" / "multiple-components.cps", path);
+
+            auto && compiled = compile(path);
+            ASSERT_TRUE(compiled.has_value()) << compiled.error();
+            ASSERT_EQ(compiled.value(), cps_dir / "multiple-components.cpsb");
+
+            stats::reset();
+            auto && p = load(path);
+            ASSERT_TRUE(p.has_value()) << p.error();
+            ASSERT_EQ(stats::counters.files_compiled, 1);
+            ASSERT_EQ(stats::counters.files_parsed, 0);
+            // Compiled files hold every component already parsed
+            for (auto && [name, comp] : p->components) {
+                ASSERT_FALSE(comp.raw.has_value()) << name;
+            }
+            auto && expected = load(path, Backend::jsoncpp);
+            ASSERT_TRUE(expected.has_value()) << expected.error();
+            expect_same(p.value(), expected.value());
+
+            // A compiled file is ignored once the CPS file changes
+            {
+                std::ofstream out{path, std::ios::app};
+                out << "\n";
+            }
+            stats::reset();
+            ASSERT_TRUE(load(path).has_value());
+            ASSERT_EQ(stats::counters.files_compiled, 0);
+            ASSERT_EQ(stats::counters.files_parsed, 1);
+        }
+
+        INSTANTIATE_TEST_SUITE_P(LoaderTest, BackendTest, ::testing::ValuesIn(test_cases()),
+                                 [](const ::testing::TestParamInfo<std::string> & p) {
+                                     std::string name = fs::path{p.param}.stem().string();
+                                     std::replace(name.begin(), name.end(), '-', '_');
+                                     return name;
+                                 });
+
+    } // unnamed namespace
+} // namespace cps::loader::test
@@ -23,10 +23,11 @@ if typing.TYPE_CHECKING:
     class TestCase(typing.TypedDict):
 
         name: str
-        cps: str
+        cps: typing.NotRequired[str]
         args: list[str]
         expected: str
         mode: typing.NotRequired[typing.Literal['pkgconf']]
+        stdin: typing.NotRequired[str]
 
     class TestDescription(typing.TypedDict):
 
@@ -59,7 +60,7 @@ class Result:
 
 
 async def test(runner: str, case_: TestCase) -> Result:
-    cmd = [runner, case_['cps']] + case_['args']
+    cmd = [runner] + ([case_['cps']] if 'cps' in case_ else []) + case_['args']
     if 'mode' in case_:
         cmd.extend([f"--format={case_['mode']}"])
 
@@ -69,10 +70,11 @@ async def test(runner: str, case_: TestCase) -> Result:
         async with asyncio.timeout(5):
             proc = await asyncio.create_subprocess_exec(
                 *cmd,
+                stdin=asyncio.subprocess.PIPE if 'stdin' in case_ else None,
                 stdout=asyncio.subprocess.PIPE,
                 stderr=asyncio.subprocess.PIPE,
             )
-        bout, berr = await proc.communicate()
+        bout, berr = await proc.communicate(case_['stdin'].encode() if 'stdin' in case_ else None)
         out = bout.decode().strip()
         err = berr.decode().strip()
 
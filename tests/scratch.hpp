@@ -0,0 +1,32 @@
+// Copyright © 2024 Dylan Baker
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <string>
+
+namespace cps::test {
+
+    /// @brief Tests which write files of their own, under a prefix removed afterwards
+    class ScratchTest : public ::testing::Test {
+      protected:
+        void SetUp() override {
+            const std::string test = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+            prefix = std::filesystem::temp_directory_path() / fmt::format("cps-test-{}-{}", test, ::getpid());
+            cps_dir = prefix / "lib" / "cps";
+            std::filesystem::create_directories(cps_dir);
+        }
+
+        void TearDown() override { std::filesystem::remove_all(prefix); }
+
+        std::filesystem::path prefix;
+        /// @brief The directory under prefix which CPS files are found in
+        std::filesystem::path cps_dir;
+    };
+
+} // namespace cps::test
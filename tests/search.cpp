@@ -0,0 +1,296 @@
+// Copyright © 2024 Dylan Baker
+// SPDX-License-Identifier: MIT
+
+#include "cps/search.hpp"
+#include "cps/stats.hpp"
+
+#include "scratch.hpp"
+
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+
+#include <pthread.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace cps::search::test {
+    namespace {
+
+        /// @brief Searches the test cases, via $CPS_PATH
+        const Context & context() {
+            static const Context c{environment()};
+            return c;
+        }
+
+        /// @brief A loader which counts how many times each file is loaded
+        /// @param loads The number of loads, by file name
+        /// @param lock Guards loads, since files are loaded concurrently
+        Loader counting_loader(std::unordered_map<std::string, int> & loads, std::mutex & lock) {
+            return [&loads, &lock](const fs::path & path) {
+                {
+                    const std::lock_guard<std::mutex> guard{lock};
+                    ++loads[path.filename().string()];
+                }
+                return loader::load(path);
+            };
+        }
+
+        using cps::test::ScratchTest;
+
+        TEST(FindPackageTest, diamond_loads_each_file_once) {
+            std::unordered_map<std::string, int> loads;
+            std::mutex loads_lock;
+            const Loader counting = counting_loader(loads, loads_lock);
+
+            auto && result = find_package(context(), "diamond", {}, true, counting);
+            ASSERT_TRUE(result.has_value()) << "Unexpected error " << result.error();
+
+            // diamond -> needs-components{1,2} -> multiple-components. minimal
+            // is required by multiple-components, but not by the components used
+            const std::unordered_map<std::string, int> expected{
+                {"diamond.cps", 1},
+                {"needs-components1.cps", 1},
+                {"needs-components2.cps", 1},
+                {"multiple-components.cps", 1},
+            };
+            ASSERT_EQ(loads, expected);
+        }
+
+        TEST(FindPackageTest, siblings_load_concurrently) {
+            // The first sibling is slowest, so the loads finish in the
+            // opposite order to the one they are needed in
+            std::atomic<int> running{0};
+            std::atomic<int> most_running{0};
+            const Loader slow = [&](const fs::path & path) {
+                const int now = ++running;
+                int most = most_running;
+                while (most < now && !most_running.compare_exchange_weak(most, now)) {
+                }
+                if (path.filename() == "needs-components1.cps") {
+                    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+                }
+                auto && p = loader::load(path);
+                --running;
+                return p;
+            };
+
+            auto && result = find_package(context(), "diamond", {}, true, slow);
+            ASSERT_TRUE(result.has_value()) << "Unexpected error " << result.error();
+            ASSERT_EQ(most_running, 2);
+
+            auto && expected = find_package(context(), "diamond", {}, true);
+            ASSERT_TRUE(expected.has_value()) << "Unexpected error " << expected.error();
+            ASSERT_EQ(result->includes, expected->includes);
+            ASSERT_EQ(result->link_location, expected->link_location);
+            ASSERT_EQ(result->link_libraries, expected->link_libraries);
+        }
+
+        TEST(FindPackageTest, unused_requires_are_not_loaded) {
+            std::unordered_map<std::string, int> loads;
+            std::mutex loads_lock;
+            const Loader counting = counting_loader(loads, loads_lock);
+
+            auto && trimmed = find_package(context(), "multiple-components", {"sample1"}, false, counting);
+            ASSERT_TRUE(trimmed.has_value()) << "Unexpected error " << trimmed.error();
+            ASSERT_EQ(loads, (std::unordered_map<std::string, int>{{"multiple-components.cps", 1}}));
+
+            loads.clear();
+            auto && external = find_package(context(), "multiple-components", {"requires-external"}, false, counting);
+            ASSERT_TRUE(external.has_value()) << "Unexpected error " << external.error();
+            const std::unordered_map<std::string, int> expected{
+                {"multiple-components.cps", 1},
+                {"minimal.cps", 1},
+            };
+            ASSERT_EQ(loads, expected);
+        }
+
+        TEST(FindPackageTest, stats_count_the_work) {
+            stats::reset();
+            auto && result = find_package(context(), "diamond", {}, true);
+            ASSERT_TRUE(result.has_value()) << "Unexpected error " << result.error();
+
+            const stats::Counters & c = stats::counters;
+            ASSERT_EQ(c.files_parsed, 4);
+            ASSERT_GT(c.bytes_read, 0);
+            // multiple-components is required with two different sets of
+            // components, which are resolved separately but loaded once
+            ASSERT_EQ(c.node_cache_misses, 5);
+            ASSERT_EQ(c.version_comparisons, 0);
+            ASSERT_GE(c.flags_before_dedup, c.flags_after_dedup);
+
+            stats::reset();
+            auto && versioned = find_package(context(), "needs-minimal-1", {}, true);
+            ASSERT_TRUE(versioned.has_value()) << "Unexpected error " << versioned.error();
+            ASSERT_EQ(stats::counters.files_parsed, 2);
+            ASSERT_EQ(stats::counters.version_comparisons, 1);
+        }
+
+        TEST(FindPackageTest, directories_are_read_once) {
+            stats::reset();
+            const Context ctx{environment()};
+            ASSERT_GT(stats::counters.dirs_probed, 0);
+
+            // Lookups, whether they find anything or not, don't look at the
+            // filesystem again. Only loading the file does.
+            stats::reset();
+            auto && first = find_package(ctx, "minimal");
+            ASSERT_TRUE(first.has_value()) << "Unexpected error " << first.error();
+            auto && second = find_package(ctx, "minimal");
+            ASSERT_TRUE(second.has_value()) << "Unexpected error " << second.error();
+            ASSERT_FALSE(find_package(ctx, "does-not-exist").has_value());
+            ASSERT_EQ(stats::counters.dirs_probed, 0);
+            ASSERT_EQ(stats::counters.files_stated, stats::counters.files_parsed);
+        }
+
+        TEST_F(ScratchTest, contexts_see_packages_installed_before_they_were_created) {
+            const char * env = std::getenv("CPS_PATH");
+            ASSERT_NE(env, nullptr) << "CPS_PATH must point at the test cases";
+            const fs::path cases = env;
+            const Options options{{prefix, cases}, std::nullopt};
+
+            const Context before{options};
+            ASSERT_FALSE(find_package(before, "late").has_value());
+            fs::copy_file(cases / "lib" / "cps" / "minimal.cps", cps_dir / "late.cps");
+            ASSERT_FALSE(find_package(before, "late").has_value());
+
+            const Context after{options};
+            auto && found = find_package(after, "late");
+            ASSERT_TRUE(found.has_value()) << "Unexpected error " << found.error();
+        }
+
+        TEST(FindPackageTest, queries_share_a_context) {
+            auto && expected = find_package(context(), "diamond", {}, true);
+            ASSERT_TRUE(expected.has_value()) << "Unexpected error " << expected.error();
+
+            std::vector<tl::expected<Result, std::string>> results(4);
+            std::vector<std::thread> threads;
+            for (auto && r : results) {
+                threads.emplace_back([&r] { r = find_package(context(), "diamond", {}, true); });
+            }
+            for (auto && t : threads) {
+                t.join();
+            }
+            for (auto && r : results) {
+                ASSERT_TRUE(r.has_value()) << "Unexpected error " << r.error();
+                ASSERT_EQ(r->includes, expected->includes);
+                ASSERT_EQ(r->link_location, expected->link_location);
+                ASSERT_EQ(r->link_libraries, expected->link_libraries);
+            }
+        }
+
+        TEST(FindPackageTest, diamond_merges_components) {
+            auto && result = find_package(context(), "diamond", {}, true);
+            ASSERT_TRUE(result.has_value()) << "Unexpected error " << result.error();
+
+            const std::vector<std::string> expected{"/something", "/opt/include"};
+            ASSERT_EQ(result->includes[loader::KnownLanguages::c], expected);
+        }
+
+        TEST(FindPackageTest, multiple_roots_share_dependencies) {
+            std::unordered_map<std::string, int> loads;
+            std::mutex loads_lock;
+            const Loader counting = counting_loader(loads, loads_lock);
+
+            auto && result = find_packages(context(), {"needs-components2", "needs-components1"}, {}, true, counting);
+            ASSERT_TRUE(result.has_value()) << "Unexpected error " << result.error();
+
+            const std::unordered_map<std::string, int> expected_loads{
+                {"needs-components1.cps", 1},
+                {"needs-components2.cps", 1},
+                {"multiple-components.cps", 1},
+            };
+            ASSERT_EQ(loads, expected_loads);
+
+            // Components are merged in the order the roots asked for them
+            const std::vector<std::string> expected{"/opt/include", "/something"};
+            ASSERT_EQ(result->includes[loader::KnownLanguages::c], expected);
+        }
+
+        TEST(FindPackageTest, version_too_old) {
+            auto && result = find_package(context(), "needs-minimal-2");
+            ASSERT_FALSE(result.has_value());
+            ASSERT_EQ(result.error(), "Could not find a dependency to satisfy minimal");
+        }
+
+        TEST(FindPackageTest, cycle_is_an_error) {
+            auto && result = find_package(context(), "cycle-a", {}, true);
+            ASSERT_FALSE(result.has_value());
+            ASSERT_EQ(result.error(), "Dependency cycle detected: cycle-a -> cycle-b -> cycle-a");
+        }
+
+        TEST_F(ScratchTest, index_is_not_trusted_for_edited_files) {
+            const fs::path cps = cps_dir / "edited.cps";
+            const auto && write = [&cps](std::string_view components) {
+                std::ofstream{cps} << fmt::format(R"({{"name": "edited", "cps_version": "0.10.0",
+                    "components": {{{}}}, "default_components": ["a"]}})",
+                                                  components);
+            };
+            write(R"("a": {"type": "interface"})");
+            const Options options{{prefix}, prefix / "index"};
+            ASSERT_TRUE(build_index(options, options.index.value()));
+
+            // The directory is unchanged, so the index is still used for it
+            write(R"("a": {"type": "interface"}, "b": {"type": "interface"})");
+            const Context ctx{options};
+            ASSERT_TRUE(ctx.indexed(cps).has_value());
+            auto && found = find_package(ctx, "edited", {"b"}, false);
+            ASSERT_TRUE(found.has_value()) << "Unexpected error " << found.error();
+        }
+
+        TEST_F(ScratchTest, deep_chains_do_not_recurse) {
+            constexpr size_t depth = 5000;
+            for (size_t i = 0; i < depth; ++i) {
+                const std::string require =
+                    i + 1 < depth ? fmt::format(R"("requires": {{"p{}": {{}}}},)", i + 1) : "";
+                const std::string comp_require = i + 1 < depth ? fmt::format(R"("requires": ["p{}:c"],)", i + 1) : "";
+                std::ofstream{cps_dir / fmt::format("p{}.cps", i)} << fmt::format(
+                    R"({{"name": "p{0}", "cps_version": "0.10.0", {1}
+                        "components": {{"c": {{"type": "interface", {2} "includes": {{"c": ["/p{0}"]}}}}}},
+                        "default_components": ["c"]}})",
+                    i, require, comp_require);
+            }
+            const Context ctx{Options{{prefix}, std::nullopt}};
+
+            // Searched on a thread with a small stack, which a level of
+            // recursion per package would overflow long before the end of the
+            // chain
+            struct Query {
+                const Context & ctx;
+                tl::expected<Result, std::string> result;
+            } query{ctx, tl::unexpected("not run")};
+            ::pthread_attr_t attr;
+            ::pthread_attr_init(&attr);
+            ::pthread_attr_setstacksize(&attr, 256 * 1024);
+            ::pthread_t thread;
+            ASSERT_EQ(::pthread_create(
+                          &thread, &attr,
+                          [](void * arg) -> void * {
+                              auto * q = static_cast<Query *>(arg);
+                              q->result = find_package(q->ctx, "p0", {}, true);
+                              return nullptr;
+                          },
+                          &query),
+                      0);
+            ::pthread_join(thread, nullptr);
+            ::pthread_attr_destroy(&attr);
+
+            auto && result = query.result;
+            ASSERT_TRUE(result.has_value()) << "Unexpected error " << result.error();
+            const std::vector<std::string> & includes = result->includes[loader::KnownLanguages::c];
+            ASSERT_EQ(includes.size(), depth);
+            ASSERT_EQ(includes.front(), "/p0");
+            ASSERT_EQ(includes.back(), fmt::format("/p{}", depth - 1));
+        }
+
+    } // unnamed namespace
+} // namespace cps::search::test
@@ -55,5 +55,118 @@ namespace cps::version::test {
                 std::tuple("0.0.0", Operator::le, "3.0", true), std::tuple("6.0.0", Operator::le, "3.0", false),
                 std::tuple("0.0.0", Operator::lt, "3.0", true), std::tuple("0.4.0", Operator::lt, "0.0", false),
                 std::tuple("0.0.0", Operator::ne, "10.0", true), std::tuple("0.0.0", Operator::ne, "0", false)));
+
+        /// @brief The sign of a comparison, so that only that is checked
+        int sign(int v) { return (v > 0) - (v < 0); }
+
+        class RpmVersionTest : public ::testing::TestWithParam<std::tuple<std::string, std::string, int>> {};
+
+        TEST_P(RpmVersionTest, compare) {
+            auto && [v1, v2, expected] = GetParam();
+            ASSERT_EQ(sign(version::rpm_compare(v1, v2)), expected) << "Case: " << v1 << " <=> " << v2;
+        }
+
+        // These are the cases from rpm's own test suite
+        INSTANTIATE_TEST_SUITE_P(
+            VersionTest, RpmVersionTest,
+            ::testing::Values(
+                std::tuple("1.0", "1.0", 0), std::tuple("1.0", "2.0", -1), std::tuple("2.0", "1.0", 1),
+                std::tuple("2.0.1", "2.0.1", 0), std::tuple("2.0", "2.0.1", -1), std::tuple("2.0.1", "2.0", 1),
+                std::tuple("2.0.1a", "2.0.1a", 0), std::tuple("2.0.1a", "2.0.1", 1), std::tuple("2.0.1", "2.0.1a", -1),
+                std::tuple("5.5p1", "5.5p1", 0), std::tuple("5.5p1", "5.5p2", -1), std::tuple("5.5p2", "5.5p1", 1),
+                std::tuple("5.5p10", "5.5p10", 0), std::tuple("5.5p1", "5.5p10", -1), std::tuple("5.5p10", "5.5p1", 1),
+                std::tuple("10xyz", "10.1xyz", -1), std::tuple("10.1xyz", "10xyz", 1), std::tuple("xyz10", "xyz10", 0),
+                std::tuple("xyz10", "xyz10.1", -1), std::tuple("xyz10.1", "xyz10", 1), std::tuple("xyz.4", "xyz.4", 0),
+                std::tuple("xyz.4", "8", -1), std::tuple("8", "xyz.4", 1), std::tuple("xyz.4", "2", -1),
+                std::tuple("2", "xyz.4", 1), std::tuple("5.5p2", "5.6p1", -1), std::tuple("5.6p1", "5.5p2", 1),
+                std::tuple("5.6p1", "6.5p1", -1), std::tuple("6.5p1", "5.6p1", 1), std::tuple("6.0.rc1", "6.0", 1),
+                std::tuple("6.0", "6.0.rc1", -1), std::tuple("10b2", "10a1", 1), std::tuple("10a2", "10b2", -1),
+                std::tuple("1.0aa", "1.0aa", 0), std::tuple("1.0a", "1.0aa", -1), std::tuple("1.0aa", "1.0a", 1),
+                std::tuple("10.0001", "10.0001", 0), std::tuple("10.0001", "10.1", 0),
+                std::tuple("10.1", "10.0001", 0), std::tuple("10.0001", "10.0039", -1),
+                std::tuple("10.0039", "10.0001", 1), std::tuple("4.999.9", "5.0", -1), std::tuple("5.0", "4.999.9", 1),
+                std::tuple("20101121", "20101121", 0), std::tuple("20101121", "20101122", -1),
+                std::tuple("20101122", "20101121", 1), std::tuple("2_0", "2_0", 0), std::tuple("2.0", "2_0", 0),
+                std::tuple("2_0", "2.0", 0), std::tuple("a", "a", 0), std::tuple("a+", "a+", 0),
+                std::tuple("a+", "a_", 0), std::tuple("a_", "a+", 0), std::tuple("+a", "+a", 0),
+                std::tuple("+a", "_a", 0), std::tuple("_a", "+a", 0), std::tuple("+_", "+_", 0),
+                std::tuple("_+", "+_", 0), std::tuple("_+", "_+", 0), std::tuple("+", "_", 0), std::tuple("_", "+", 0),
+                std::tuple("1.0~rc1", "1.0~rc1", 0), std::tuple("1.0~rc1", "1.0", -1), std::tuple("1.0", "1.0~rc1", 1),
+                std::tuple("1.0~rc1", "1.0~rc2", -1), std::tuple("1.0~rc2", "1.0~rc1", 1),
+                std::tuple("1.0~rc1~git123", "1.0~rc1~git123", 0), std::tuple("1.0~rc1~git123", "1.0~rc1", -1),
+                std::tuple("1.0~rc1", "1.0~rc1~git123", 1), std::tuple("1.0^", "1.0^", 0),
+                std::tuple("1.0^", "1.0", 1), std::tuple("1.0", "1.0^", -1), std::tuple("1.0^git1", "1.0^git1", 0),
+                std::tuple("1.0^git1", "1.0", 1), std::tuple("1.0", "1.0^git1", -1),
+                std::tuple("1.0^git1", "1.0^git2", -1), std::tuple("1.0^git2", "1.0^git1", 1),
+                std::tuple("1.0^git1", "1.01", -1), std::tuple("1.01", "1.0^git1", 1),
+                std::tuple("1.0^20160101", "1.0^20160101", 0), std::tuple("1.0^20160101", "1.0.1", -1),
+                std::tuple("1.0.1", "1.0^20160101", 1), std::tuple("1.0^20160101^git1", "1.0^20160101^git1", 0),
+                std::tuple("1.0^20160102", "1.0^20160101^git1", 1),
+                std::tuple("1.0^20160101^git1", "1.0^20160102", -1), std::tuple("1.0~rc1^git1", "1.0~rc1^git1", 0),
+                std::tuple("1.0~rc1^git1", "1.0~rc1", 1), std::tuple("1.0~rc1", "1.0~rc1^git1", -1),
+                std::tuple("1.0^git1~pre", "1.0^git1~pre", 0), std::tuple("1.0^git1", "1.0^git1~pre", 1),
+                std::tuple("1.0^git1~pre", "1.0^git1", -1),
+                std::tuple("12345678901234567890123", "12345678901234567890124", -1)));
+
+        class DpkgVersionTest : public ::testing::TestWithParam<std::tuple<std::string, std::string, int>> {};
+
+        TEST_P(DpkgVersionTest, compare) {
+            auto && [v1, v2, expected] = GetParam();
+            auto && result = version::dpkg_compare(v1, v2);
+            ASSERT_TRUE(result.has_value()) << "Unexpected error " << result.error();
+            ASSERT_EQ(sign(result.value()), expected) << "Case: " << v1 << " <=> " << v2;
+        }
+
+        INSTANTIATE_TEST_SUITE_P(
+            VersionTest, DpkgVersionTest,
+            ::testing::Values(
+                std::tuple("1.0", "1.0", 0), std::tuple("1.0", "1.1", -1), std::tuple("1.1", "1.0", 1),
+                std::tuple("1:1.0", "2.0", 1), std::tuple("2:1.0", "10:0.1", -1), std::tuple("0:1.0", "1.0", 0),
+                std::tuple("1.0-1", "1.0-2", -1), std::tuple("1.0", "1.0-0", 0),
+                std::tuple("1.0-1ubuntu1", "1.0-1", 1), std::tuple("1.2.3-4-5", "1.2.3-4-6", -1),
+                std::tuple("1.0a", "1.0", 1), std::tuple("1.0", "1.0+b1", -1), std::tuple("1.0~rc1", "1.0", -1),
+                std::tuple("1.0~", "1.0", -1), std::tuple("1.0~~", "1.0~", -1), std::tuple("1.0~~a", "1.0~~", 1),
+                std::tuple("1.0a", "1.0+", -1), std::tuple("1.001", "1.1", 0), std::tuple("1.10", "1.9", 1)));
+
+        TEST(DpkgVersionTest, invalid_epoch) {
+            auto && result = version::dpkg_compare("a:1.0", "1.0");
+            ASSERT_FALSE(result.has_value());
+            ASSERT_EQ(result.error(), "'a' is not a valid epoch");
+        }
+
+        TEST(VersionCompareTest, schemas) {
+            ASSERT_EQ(version::compare("1.0~rc1", Operator::lt, "1.0", Schema::rpm), true);
+            ASSERT_EQ(version::compare("1:0.1", Operator::gt, "2.0", Schema::dpkg), true);
+            ASSERT_FALSE(version::compare("1.0", Operator::lt, "2.0", Schema::custom).has_value());
+        }
+
+        TEST(VersionParseTest, trailing_zeros) {
+            auto && v = Version::parse("1.2.0.0");
+            ASSERT_TRUE(v.has_value()) << "Unexpected error " << v.error();
+            ASSERT_EQ(v->size(), 2);
+            ASSERT_EQ(v->part(1), 2);
+            ASSERT_EQ(v->part(5), 0);
+        }
+
+        TEST(VersionParseTest, too_many_parts) {
+            ASSERT_TRUE(Version::parse("1.2.3.4.5.6.7.8.0.0").has_value());
+            ASSERT_FALSE(Version::parse("1.2.3.4.5.6.7.8.9").has_value());
+
+            // Which are still compared, from the string
+            ASSERT_EQ(version::compare("1.2.3.4.5.6.7.8.9", Operator::gt, "1.2.3.4.5.6.7.8", Schema::simple), true);
+            ASSERT_EQ(version::compare("1.2.3.4.5.6.7.8.9", Operator::lt, "1.2.3.4.5.6.7.8.10", Schema::simple), true);
+            ASSERT_EQ(version::compare("1.2.3.4.5.6.7.8.9.0", Operator::eq, "1.2.3.4.5.6.7.8.9", Schema::simple),
+                      true);
+            ASSERT_FALSE(version::compare("1.2.3.4.5.6.7.8.9.a", Operator::eq, "1", Schema::simple).has_value());
+        }
+
+        TEST(VersionParseTest, errors) {
+            auto && invalid = Version::parse("1..2");
+            ASSERT_FALSE(invalid.has_value());
+            ASSERT_EQ(invalid.error(), "'' is not a valid number");
+
+            ASSERT_FALSE(Version::parse("1.a").has_value());
+            ASSERT_FALSE(Version::parse("99999999999999999999999").has_value());
+        }
     } // unnamed namespace
 } // namespace cps::version::test